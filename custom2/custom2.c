@@ -14,11 +14,27 @@ typedef struct _CustomObject {
     int number;
 } CustomObject;
 
+static PyTypeObject CustomType;
+
+// 破棄された Custom を捨てずに取っておき、次の Custom_new で使い回す
+// サブクラスのインスタンスは __dict__ などを持ち大きさも違うので対象にしない
+// GIL を持った状態でしか触らないのでロックは不要
+#define CUSTOM_MAXFREE 1024
+static CustomObject *free_list[CUSTOM_MAXFREE];
+static int numfree = 0;
+
+// first, last の既定値として共有する空文字列
+static PyObject *empty_string;
+
 // あとで tp_dealloc に代入する
 static void
 Custom_dealloc(CustomObject *self) {
     Py_XDECREF(self->first);
     Py_XDECREF(self->last);
+    if (Py_IS_TYPE(self, &CustomType) && numfree < CUSTOM_MAXFREE) {
+        free_list[numfree++] = self;
+        return;
+    }
     // Py_TYPEが返す型はサブクラスの可能性もある
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
@@ -28,20 +44,25 @@ Custom_dealloc(CustomObject *self) {
 static PyObject *
 Custom_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
     CustomObject *self;
+    if (type == &CustomType && numfree > 0) {
+        // 参照カウントと型を初期化し直すだけで、メモリの確保は行わない
+        self = free_list[--numfree];
+        PyObject_Init((PyObject *) self, type);
+        Py_INCREF(empty_string);
+        self->first = empty_string;
+        Py_INCREF(empty_string);
+        self->last = empty_string;
+        self->number = 0;
+        return (PyObject *) self;
+    }
     // 失敗時は NULL
     // tp_alloc は PyType_Ready() がセットしている
     self = ((CustomObject *) type->tp_alloc(type, 0));
     if (self != NULL) {
-        self->first = PyUnicode_FromString("");
-        if (self->first == NULL) {
-            Py_DECREF(self);
-            return NULL;
-        }
-        self->last = PyUnicode_FromString("");
-        if (self->last == NULL) {
-            Py_DECREF(self);
-            return NULL;
-        }
+        Py_INCREF(empty_string);
+        self->first = empty_string;
+        Py_INCREF(empty_string);
+        self->last = empty_string;
         self->number = 0;
     }
     return (PyObject *) self;
@@ -113,12 +134,29 @@ static PyTypeObject CustomType = {
         .tp_methods = Custom_methods,
 };
 
+// 取っておいた Custom をすべて解放し、その数を返す
+static PyObject *
+clear_freelist(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    int n = numfree;
+    while (numfree > 0) {
+        CustomObject *op = free_list[--numfree];
+        CustomType.tp_free((PyObject *) op);
+    }
+    return PyLong_FromLong(n);
+}
+
+static PyMethodDef custom_methods[] = {
+        {"clear_freelist", clear_freelist, METH_NOARGS, "Free the Custom objects kept for reuse and return how many there were"},
+        {NULL, NULL, 0, NULL},
+};
+
 // https://docs.python.org/ja/3/c-api/module.html#c.PyModuleDef
 static PyModuleDef custommodule = {
         PyModuleDef_HEAD_INIT,
         .m_name = "custom2",
         .m_doc = "Example module that creates an extension type.",
         .m_size = -1,
+        .m_methods = custom_methods,
 };
 
 PyMODINIT_FUNC
@@ -128,6 +166,12 @@ PyInit_custom2(void) {
     if (PyType_Ready(&CustomType) > 0) {
         return NULL;
     }
+    if (empty_string == NULL) {
+        empty_string = PyUnicode_FromString("");
+        if (empty_string == NULL) {
+            return NULL;
+        }
+    }
     m = PyModule_Create(&custommodule);
     if (m == NULL)
         return NULL;
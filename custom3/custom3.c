@@ -11,14 +11,268 @@ typedef struct _CustomObject {
     PyObject ob_base;  // == PyObject_HEAD
     PyObject *first;
     PyObject *last;
+    PyObject *name;  // name() の結果のキャッシュ。first, last を変えたら捨てる
     int number;
+    // first, last をインターン表で数えてもらったときの世代。0 なら数えられていない
+    uint64_t first_generation;
+    uint64_t last_generation;
 } CustomObject;
 
+// ---- 名前のインターン ----
+// set_interning(True) の間、first と last に入れる str を同じ内容の既存のオブジェクトに置き換える
+// 同じ名前を持つレコードが大量にあっても str の実体は 1 つで済む
+// 表はオープンアドレス法で強参照を持ち、要素ごとにそれを使っている Custom の数を数える
+// str は弱参照を作れないので、どの Custom も使わなくなった要素は次のときにまとめて捨てる
+//   - 要素を追加して表が埋まってきたとき
+//   - 使われていない要素が INTERN_COMPACT_MIN 個以上かつ全体の半分を超えたとき
+//   - intern_purge() を呼んだとき
+// 参照カウントは str の定数やシングルトンでは当てにならないので使わない
+
+#define INTERN_COMPACT_MIN 1024
+
+typedef struct {
+    PyObject *str;
+    Py_ssize_t uses;  // この str を first, last に持っている Custom の数
+} InternEntry;
+
+static int interning = 0;
+static InternEntry *intern_table = NULL;
+static Py_ssize_t intern_size = 0;   // 2 の冪
+static Py_ssize_t intern_used = 0;
+static Py_ssize_t intern_unused = 0;  // uses が 0 の要素の数
+static Py_ssize_t intern_hits = 0;    // 既存のオブジェクトに置き換えた回数
+static Py_ssize_t intern_misses = 0;  // 新しく登録した回数
+// 表を捨てるたびに進める。Custom は数えてもらったときの世代を持ち、違えば表に返さない
+static uint64_t intern_generation = 1;
+
+static void
+intern_insert(InternEntry *table, Py_ssize_t size, InternEntry *e) {
+    Py_ssize_t i = PyObject_Hash(e->str) & (size - 1);
+    while (table[i].str != NULL) {
+        i = (i + 1) & (size - 1);
+    }
+    table[i] = *e;
+}
+
+// 使われなくなった要素を捨て、残りが 1/3 以下の埋まり具合になる大きさで作り直す
+// Custom の解放中からも呼ばれるので、失敗しても例外は設定しない
+static Py_ssize_t
+intern_rebuild(void) {
+    InternEntry *table;
+    Py_ssize_t i, live = intern_used - intern_unused, size = 8;
+
+    while (size < (live + 1) * 3) {
+        size *= 2;
+    }
+    table = PyMem_Calloc(size, sizeof(InternEntry));
+    if (table == NULL) {
+        return -1;
+    }
+    for (i = 0; i < intern_size; i++) {
+        InternEntry *e = &intern_table[i];
+        if (e->str == NULL) {
+            continue;
+        }
+        if (e->uses > 0) {
+            intern_insert(table, size, e);
+        } else {
+            Py_DECREF(e->str);
+        }
+    }
+    PyMem_Free(intern_table);
+    intern_table = table;
+    intern_size = size;
+    intern_used = live;
+    i = intern_unused;
+    intern_unused = 0;
+    return i;
+}
+
+static void
+intern_clear(void) {
+    Py_ssize_t i;
+
+    for (i = 0; i < intern_size; i++) {
+        Py_XDECREF(intern_table[i].str);
+    }
+    PyMem_Free(intern_table);
+    intern_table = NULL;
+    intern_size = 0;
+    intern_used = 0;
+    intern_unused = 0;
+    // 0 は「数えていない」の印。64 ビットなので一周して古い Custom の世代と重なることはない
+    intern_generation++;
+}
+
+// s と同じ内容の要素を探し、なければ追加する。インターンしないときは *found に NULL を入れる
+static int
+intern_find(PyObject *s, InternEntry **found) {
+    Py_hash_t hash;
+    Py_ssize_t i;
+
+    *found = NULL;
+    // str のサブクラスは属性を持ちうるので置き換えない
+    if (!interning || !PyUnicode_CheckExact(s)) {
+        return 0;
+    }
+    hash = PyObject_Hash(s);
+    if (hash == -1) {
+        return -1;
+    }
+    if ((intern_used + 1) * 3 > intern_size * 2 && intern_rebuild() < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = hash & (intern_size - 1); intern_table[i].str != NULL; i = (i + 1) & (intern_size - 1)) {
+        InternEntry *e = &intern_table[i];
+        // str のハッシュはオブジェクトにキャッシュされているので PyObject_Hash は安い
+        if (e->str == s || (PyObject_Hash(e->str) == hash && PyUnicode_Compare(e->str, s) == 0)) {
+            if (e->str != s) {
+                intern_hits++;
+            }
+            *found = e;
+            return 0;
+        }
+    }
+    Py_INCREF(s);
+    intern_table[i].str = s;
+    intern_table[i].uses = 0;
+    intern_used++;
+    intern_unused++;
+    intern_misses++;
+    *found = &intern_table[i];
+    return 0;
+}
+
+// Custom が手放す s を数から外す。generation は s を持たせたときの intern_set() の結果
+static void
+intern_release(PyObject *s, uint64_t generation) {
+    Py_ssize_t i;
+
+    if (s == NULL || generation != intern_generation || intern_table == NULL) {
+        return;
+    }
+    // 表にある str はハッシュ計算済みなので失敗しない
+    for (i = PyObject_Hash(s) & (intern_size - 1); intern_table[i].str != NULL; i = (i + 1) & (intern_size - 1)) {
+        InternEntry *e = &intern_table[i];
+        if (e->str == s) {
+            if (e->uses > 0 && --e->uses == 0) {
+                intern_unused++;
+                if (intern_unused >= INTERN_COMPACT_MIN && intern_unused * 2 > intern_used) {
+                    intern_rebuild();
+                }
+            }
+            return;
+        }
+    }
+}
+
+// *slot を value（をインターンしたもの）に置き換え、元の値を手放す。*generation も合わせて更新する
+static int
+intern_set(PyObject **slot, uint64_t *generation, PyObject *value) {
+    InternEntry *e;
+    PyObject *old = *slot;
+    uint64_t old_generation = *generation;
+
+    if (intern_find(value, &e) < 0) {
+        return -1;
+    }
+    if (e != NULL) {
+        value = e->str;
+        if (e->uses++ == 0) {
+            intern_unused--;
+        }
+        *generation = intern_generation;
+    } else {
+        *generation = 0;
+    }
+    Py_INCREF(value);
+    *slot = value;
+    // 表を作り直すことがあるので e はもう使わない
+    intern_release(old, old_generation);
+    Py_XDECREF(old);
+    return 0;
+}
+
+// set_interning(enabled) -> 以前の設定。無効にすると表も捨てる
+static PyObject *
+set_interning(PyObject *self, PyObject *arg) {
+    int enabled = PyObject_IsTrue(arg);
+    int previous = interning;
+
+    if (enabled < 0) {
+        return NULL;
+    }
+    interning = enabled;
+    if (!enabled) {
+        intern_clear();
+    }
+    return PyBool_FromLong(previous);
+}
+
+// intern_purge() -> どの Custom も使っていない要素を捨て、その数を返す
+static PyObject *
+intern_purge(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_ssize_t n;
+
+    if (intern_table == NULL) {
+        return PyLong_FromLong(0);
+    }
+    n = intern_rebuild();
+    if (n < 0) {
+        return PyErr_NoMemory();
+    }
+    return PyLong_FromSsize_t(n);
+}
+
+// 表の状態と節約できたバイト数の見積もりを返す
+// n 個の Custom が使っている要素は、インターンしなければ n 個の別々の str になっていたとみなす
+static PyObject *
+intern_stats(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_ssize_t i, refs = 0, saved = 0, held = 0;
+
+    for (i = 0; i < intern_size; i++) {
+        InternEntry *e = &intern_table[i];
+        PyObject *size;
+        Py_ssize_t bytes;
+        if (e->str == NULL) {
+            continue;
+        }
+        size = PyObject_CallMethod(e->str, "__sizeof__", NULL);
+        if (size == NULL) {
+            return NULL;
+        }
+        bytes = PyLong_AsSsize_t(size);
+        Py_DECREF(size);
+        if (bytes == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        held += bytes;
+        refs += e->uses;
+        if (e->uses > 1) {
+            saved += (e->uses - 1) * bytes;
+        }
+    }
+    return Py_BuildValue("{s:O,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "enabled", interning ? Py_True : Py_False,
+                         "entries", intern_used,
+                         "live", intern_used - intern_unused,
+                         "references", refs,
+                         "hits", intern_hits,
+                         "misses", intern_misses,
+                         "table_bytes", intern_size * (Py_ssize_t) sizeof(InternEntry),
+                         "string_bytes", held,
+                         "bytes_saved", saved);
+}
+
 // あとで tp_dealloc に代入する
 static void
 Custom_dealloc(CustomObject *self) {
+    intern_release(self->first, self->first_generation);
+    intern_release(self->last, self->last_generation);
     Py_XDECREF(self->first);
     Py_XDECREF(self->last);
+    Py_XDECREF(self->name);
     // Py_TYPEが返す型はサブクラスの可能性もある
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
@@ -52,7 +306,7 @@ Custom_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 static int
 Custom_init(CustomObject *self, PyObject *args, PyObject *kwds) {
     static char *kwlist[] = {"first", "last", "number", NULL};
-    PyObject *first = NULL, *last = NULL, *tmp;
+    PyObject *first = NULL, *last = NULL;
     // first, last は文字列のみを許可する
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|UUi", kwlist, &first, &last, &self->number)) {
         return -1;
@@ -60,16 +314,16 @@ Custom_init(CustomObject *self, PyObject *args, PyObject *kwds) {
     // tp_init は複数回呼び出しても良いので実装時には注意が必要
     // 逆に unpickle 時など呼ばれないこともあるのでこちらも注意が必要
     if (first) {
-        tmp = self->first;
-        Py_INCREF(first);
-        self->first = first;
-        Py_XDECREF(tmp);
+        if (intern_set(&self->first, &self->first_generation, first) < 0) {
+            return -1;
+        }
+        Py_CLEAR(self->name);
     }
     if (last) {
-        tmp = self->last;
-        Py_INCREF(last);
-        self->last = last;
-        Py_XDECREF(tmp);
+        if (intern_set(&self->last, &self->last_generation, last) < 0) {
+            return -1;
+        }
+        Py_CLEAR(self->name);
     }
     return 0;
 }
@@ -88,7 +342,6 @@ Custom_getfirst(CustomObject *self, void *closure) {
 
 static int
 Custom_setfirst(CustomObject *self, PyObject *value, void *closure) {
-    PyObject *tmp;
     // del 時に NULL が渡されてくる
     if (value == NULL) {
         PyErr_SetString(PyExc_AttributeError, "Cannnot delete the first attribute");
@@ -98,10 +351,10 @@ Custom_setfirst(CustomObject *self, PyObject *value, void *closure) {
         PyErr_SetString(PyExc_AttributeError, "The first attribute value must be a string");
         return -1;
     }
-    tmp = self->first;
-    Py_INCREF(value);
-    self->first = value;
-    Py_DECREF(tmp);
+    if (intern_set(&self->first, &self->first_generation, value) < 0) {
+        return -1;
+    }
+    Py_CLEAR(self->name);
     return 0;
 }
 
@@ -113,7 +366,6 @@ Custom_getlast(CustomObject *self, void *closure) {
 
 static int
 Custom_setlast(CustomObject *self, PyObject *value, void *closure) {
-    PyObject *tmp;
     if (value == NULL) {
         PyErr_SetString(PyExc_AttributeError, "Cannnot delete the last attribute");
         return -1;
@@ -122,10 +374,10 @@ Custom_setlast(CustomObject *self, PyObject *value, void *closure) {
         PyErr_SetString(PyExc_AttributeError, "The last attribute value must be a string");
         return -1;
     }
-    tmp = self->last;
-    Py_INCREF(value);
-    self->last = value;
-    Py_DECREF(tmp);
+    if (intern_set(&self->last, &self->last_generation, value) < 0) {
+        return -1;
+    }
+    Py_CLEAR(self->name);
     return 0;
 }
 
@@ -146,7 +398,19 @@ Custom_name(CustomObject *self, PyObject *Py_UNUSED(ignored)) {
         PyErr_SetString(PyExc_AttributeError, "last");
         return NULL;
     }
-    return PyUnicode_FromFormat("%S %S", self->first, self->last);
+    if (self->name == NULL) {
+        PyObject *name = PyUnicode_FromFormat("%S %S", self->first, self->last);
+        if (name == NULL) {
+            return NULL;
+        }
+        // str のサブクラスは __str__ が毎回同じ結果を返すとは限らないのでキャッシュしない
+        if (!PyUnicode_CheckExact(self->first) || !PyUnicode_CheckExact(self->last)) {
+            return name;
+        }
+        self->name = name;
+    }
+    Py_INCREF(self->name);
+    return self->name;
 }
 
 static PyMethodDef Custom_methods[] = {
@@ -170,12 +434,22 @@ static PyTypeObject CustomType = {
         .tp_getset = Custom_getsetters,
 };
 
+static PyMethodDef custom_methods[] = {
+        {"set_interning", set_interning, METH_O,
+         "Share one str object between equal first/last names. Returns the previous setting"},
+        {"intern_stats", intern_stats, METH_NOARGS, "Return a dict describing the name interning table"},
+        {"intern_purge", intern_purge, METH_NOARGS,
+         "Drop interned names no Custom object uses any more. Returns the number dropped"},
+        {NULL, NULL, 0, NULL},
+};
+
 // https://docs.python.org/ja/3/c-api/module.html#c.PyModuleDef
 static PyModuleDef custommodule = {
         PyModuleDef_HEAD_INIT,
         .m_name = "custom3",
         .m_doc = "Example module that creates an extension type.",
         .m_size = -1,
+        .m_methods = custom_methods,
 };
 
 PyMODINIT_FUNC
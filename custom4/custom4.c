@@ -11,9 +11,481 @@ typedef struct _CustomObject {
     PyObject ob_base;  // == PyObject_HEAD
     PyObject *first;
     PyObject *last;
+    PyObject *name;  // name() の結果のキャッシュ。first, last を変えたら捨てる
     int number;
+    // first, last をインターン表で数えてもらったときの世代。0 なら数えられていない
+    uint64_t first_generation;
+    uint64_t last_generation;
 } CustomObject;
 
+// ---- 名前のインターン ----
+// set_interning(True) の間、first と last に入れる str を同じ内容の既存のオブジェクトに置き換える
+// 同じ名前を持つレコードが大量にあっても str の実体は 1 つで済む
+// 表はオープンアドレス法で強参照を持ち、要素ごとにそれを使っている Custom の数を数える
+// str は弱参照を作れないので、どの Custom も使わなくなった要素は次のときにまとめて捨てる
+//   - 要素を追加して表が埋まってきたとき
+//   - 使われていない要素が INTERN_COMPACT_MIN 個以上かつ全体の半分を超えたとき
+//   - intern_purge() を呼んだとき
+// 参照カウントは str の定数やシングルトンでは当てにならないので使わない
+
+#define INTERN_COMPACT_MIN 1024
+
+typedef struct {
+    PyObject *str;
+    Py_ssize_t uses;  // この str を first, last に持っている Custom の数
+} InternEntry;
+
+static int interning = 0;
+static InternEntry *intern_table = NULL;
+static Py_ssize_t intern_size = 0;   // 2 の冪
+static Py_ssize_t intern_used = 0;
+static Py_ssize_t intern_unused = 0;  // uses が 0 の要素の数
+static Py_ssize_t intern_hits = 0;    // 既存のオブジェクトに置き換えた回数
+static Py_ssize_t intern_misses = 0;  // 新しく登録した回数
+// 表を捨てるたびに進める。Custom は数えてもらったときの世代を持ち、違えば表に返さない
+static uint64_t intern_generation = 1;
+
+static void
+intern_insert(InternEntry *table, Py_ssize_t size, InternEntry *e) {
+    Py_ssize_t i = PyObject_Hash(e->str) & (size - 1);
+    while (table[i].str != NULL) {
+        i = (i + 1) & (size - 1);
+    }
+    table[i] = *e;
+}
+
+// 使われなくなった要素を捨て、残りが 1/3 以下の埋まり具合になる大きさで作り直す
+// Custom の解放中からも呼ばれるので、失敗しても例外は設定しない
+static Py_ssize_t
+intern_rebuild(void) {
+    InternEntry *table;
+    Py_ssize_t i, live = intern_used - intern_unused, size = 8;
+
+    while (size < (live + 1) * 3) {
+        size *= 2;
+    }
+    table = PyMem_Calloc(size, sizeof(InternEntry));
+    if (table == NULL) {
+        return -1;
+    }
+    for (i = 0; i < intern_size; i++) {
+        InternEntry *e = &intern_table[i];
+        if (e->str == NULL) {
+            continue;
+        }
+        if (e->uses > 0) {
+            intern_insert(table, size, e);
+        } else {
+            Py_DECREF(e->str);
+        }
+    }
+    PyMem_Free(intern_table);
+    intern_table = table;
+    intern_size = size;
+    intern_used = live;
+    i = intern_unused;
+    intern_unused = 0;
+    return i;
+}
+
+static void
+intern_clear(void) {
+    Py_ssize_t i;
+
+    for (i = 0; i < intern_size; i++) {
+        Py_XDECREF(intern_table[i].str);
+    }
+    PyMem_Free(intern_table);
+    intern_table = NULL;
+    intern_size = 0;
+    intern_used = 0;
+    intern_unused = 0;
+    // 0 は「数えていない」の印。64 ビットなので一周して古い Custom の世代と重なることはない
+    intern_generation++;
+}
+
+// s と同じ内容の要素を探し、なければ追加する。インターンしないときは *found に NULL を入れる
+static int
+intern_find(PyObject *s, InternEntry **found) {
+    Py_hash_t hash;
+    Py_ssize_t i;
+
+    *found = NULL;
+    // str のサブクラスは属性を持ちうるので置き換えない
+    if (!interning || !PyUnicode_CheckExact(s)) {
+        return 0;
+    }
+    hash = PyObject_Hash(s);
+    if (hash == -1) {
+        return -1;
+    }
+    if ((intern_used + 1) * 3 > intern_size * 2 && intern_rebuild() < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = hash & (intern_size - 1); intern_table[i].str != NULL; i = (i + 1) & (intern_size - 1)) {
+        InternEntry *e = &intern_table[i];
+        // str のハッシュはオブジェクトにキャッシュされているので PyObject_Hash は安い
+        if (e->str == s || (PyObject_Hash(e->str) == hash && PyUnicode_Compare(e->str, s) == 0)) {
+            if (e->str != s) {
+                intern_hits++;
+            }
+            *found = e;
+            return 0;
+        }
+    }
+    Py_INCREF(s);
+    intern_table[i].str = s;
+    intern_table[i].uses = 0;
+    intern_used++;
+    intern_unused++;
+    intern_misses++;
+    *found = &intern_table[i];
+    return 0;
+}
+
+// Custom が手放す s を数から外す。generation は s を持たせたときの intern_set() の結果
+static void
+intern_release(PyObject *s, uint64_t generation) {
+    Py_ssize_t i;
+
+    if (s == NULL || generation != intern_generation || intern_table == NULL) {
+        return;
+    }
+    // 表にある str はハッシュ計算済みなので失敗しない
+    for (i = PyObject_Hash(s) & (intern_size - 1); intern_table[i].str != NULL; i = (i + 1) & (intern_size - 1)) {
+        InternEntry *e = &intern_table[i];
+        if (e->str == s) {
+            if (e->uses > 0 && --e->uses == 0) {
+                intern_unused++;
+                if (intern_unused >= INTERN_COMPACT_MIN && intern_unused * 2 > intern_used) {
+                    intern_rebuild();
+                }
+            }
+            return;
+        }
+    }
+}
+
+// *slot を value（をインターンしたもの）に置き換え、元の値を手放す。*generation も合わせて更新する
+static int
+intern_set(PyObject **slot, uint64_t *generation, PyObject *value) {
+    InternEntry *e;
+    PyObject *old = *slot;
+    uint64_t old_generation = *generation;
+
+    if (intern_find(value, &e) < 0) {
+        return -1;
+    }
+    if (e != NULL) {
+        value = e->str;
+        if (e->uses++ == 0) {
+            intern_unused--;
+        }
+        *generation = intern_generation;
+    } else {
+        *generation = 0;
+    }
+    Py_INCREF(value);
+    *slot = value;
+    // 表を作り直すことがあるので e はもう使わない
+    intern_release(old, old_generation);
+    Py_XDECREF(old);
+    return 0;
+}
+
+// s と同じ内容のインターン済みの str を新しい参照で返す。インターンしないときは s 自身
+// 数えるのは Custom に持たせる intern_set() のときだけ
+static PyObject *
+intern_name(PyObject *s) {
+    InternEntry *e;
+
+    if (intern_find(s, &e) < 0) {
+        return NULL;
+    }
+    if (e != NULL) {
+        s = e->str;
+    }
+    Py_INCREF(s);
+    return s;
+}
+
+// set_interning(enabled) -> 以前の設定。無効にすると表も捨てる
+static PyObject *
+set_interning(PyObject *self, PyObject *arg) {
+    int enabled = PyObject_IsTrue(arg);
+    int previous = interning;
+
+    if (enabled < 0) {
+        return NULL;
+    }
+    interning = enabled;
+    if (!enabled) {
+        intern_clear();
+    }
+    return PyBool_FromLong(previous);
+}
+
+// intern_purge() -> どの Custom も使っていない要素を捨て、その数を返す
+static PyObject *
+intern_purge(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_ssize_t n;
+
+    if (intern_table == NULL) {
+        return PyLong_FromLong(0);
+    }
+    n = intern_rebuild();
+    if (n < 0) {
+        return PyErr_NoMemory();
+    }
+    return PyLong_FromSsize_t(n);
+}
+
+// 表の状態と節約できたバイト数の見積もりを返す
+// n 個の Custom が使っている要素は、インターンしなければ n 個の別々の str になっていたとみなす
+static PyObject *
+intern_stats(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_ssize_t i, refs = 0, saved = 0, held = 0;
+
+    for (i = 0; i < intern_size; i++) {
+        InternEntry *e = &intern_table[i];
+        PyObject *size;
+        Py_ssize_t bytes;
+        if (e->str == NULL) {
+            continue;
+        }
+        size = PyObject_CallMethod(e->str, "__sizeof__", NULL);
+        if (size == NULL) {
+            return NULL;
+        }
+        bytes = PyLong_AsSsize_t(size);
+        Py_DECREF(size);
+        if (bytes == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        held += bytes;
+        refs += e->uses;
+        if (e->uses > 1) {
+            saved += (e->uses - 1) * bytes;
+        }
+    }
+    return Py_BuildValue("{s:O,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "enabled", interning ? Py_True : Py_False,
+                         "entries", intern_used,
+                         "live", intern_used - intern_unused,
+                         "references", refs,
+                         "hits", intern_hits,
+                         "misses", intern_misses,
+                         "table_bytes", intern_size * (Py_ssize_t) sizeof(InternEntry),
+                         "string_bytes", held,
+                         "bytes_saved", saved);
+}
+
+static PyTypeObject CustomType;
+
+// 破棄された Custom を捨てずに取っておき、次の Custom_new で使い回す
+// サブクラスのインスタンスは __dict__ などを持ち大きさも違うので対象にしない
+// GIL を持った状態でしか触らないのでロックは不要
+#define CUSTOM_MAXFREE 1024
+static CustomObject *free_list[CUSTOM_MAXFREE];
+static int numfree = 0;
+
+// first, last の既定値として共有する空文字列
+static PyObject *empty_string;
+
+// ---- スラブアリーナ ----
+// 1 MiB のスラブを固定長のスロットに区切り、Custom をそこから切り出す
+// 続けて作ったオブジェクトがメモリ上でも隣り合うので、まとめて作って順に舐める処理でキャッシュに乗りやすい
+// GC 対象のオブジェクトは PyObject の直前に GC 用のヘッダを持つので、スロットはヘッダ込みで確保する
+// ヘッダの定義は公開されていないが 3.8 以降は 2 ワードなので、その前提が正しいかを import 時に確かめ、
+// 違っていればアリーナは使わずに通常の tp_alloc に任せる
+
+#define SLAB_SIZE (1 << 20)
+#define CUSTOM_GC_PRESIZE (2 * sizeof(uintptr_t))
+#define SLOT_SIZE ((CUSTOM_GC_PRESIZE + sizeof(CustomObject) + 15) & ~(size_t) 15)
+#define SLAB_SLOTS (SLAB_SIZE / SLOT_SIZE)
+
+typedef struct Slab {
+    char *mem;
+    Py_ssize_t live;     // 使われているスロットの数
+    Py_ssize_t bump;     // まだ一度も使っていない最初のスロット
+    void *free;          // 返されたスロットの連結リスト。スロットの先頭に次へのポインタを置く
+    struct Slab *prev;   // 空きのあるスラブのリスト
+    struct Slab *next;
+    int in_partial;
+} Slab;
+
+static int arena_usable = 0;   // GC ヘッダの大きさが想定どおりなら 1
+static int arena_enabled = 0;  // Custom() もアリーナから確保する
+static Slab **slabs = NULL;    // mem の昇順。解放時にどのスラブのものかを二分探索で引く
+static Py_ssize_t nslabs = 0;
+static Slab *cur_slab = NULL;  // いま切り出しているスラブ
+static Slab *partial = NULL;   // cur_slab 以外で空きのあるスラブ
+
+// op を含むスラブ。アリーナのものでなければ NULL
+static Slab *
+arena_find(void *op) {
+    char *p = (char *) op;
+    Py_ssize_t lo = 0, hi = nslabs;
+
+    while (lo < hi) {
+        Py_ssize_t mid = (lo + hi) / 2;
+        if (p < slabs[mid]->mem) {
+            hi = mid;
+        } else if (p >= slabs[mid]->mem + SLAB_SIZE) {
+            lo = mid + 1;
+        } else {
+            return slabs[mid];
+        }
+    }
+    return NULL;
+}
+
+static void
+partial_remove(Slab *slab) {
+    if (!slab->in_partial) {
+        return;
+    }
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+    slab->in_partial = 0;
+}
+
+static void
+partial_push(Slab *slab) {
+    slab->prev = NULL;
+    slab->next = partial;
+    if (partial != NULL) {
+        partial->prev = slab;
+    }
+    partial = slab;
+    slab->in_partial = 1;
+}
+
+static Slab *
+slab_new(void) {
+    Slab *slab, **grown;
+    Py_ssize_t i;
+
+    slab = PyMem_RawCalloc(1, sizeof(Slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->mem = PyMem_RawMalloc(SLAB_SIZE);
+    grown = PyMem_RawRealloc(slabs, (nslabs + 1) * sizeof(Slab *));
+    if (slab->mem == NULL || grown == NULL) {
+        PyMem_RawFree(slab->mem);
+        PyMem_RawFree(slab);
+        if (grown != NULL) {
+            slabs = grown;
+        }
+        return NULL;
+    }
+    slabs = grown;
+    for (i = nslabs; i > 0 && slabs[i - 1]->mem > slab->mem; i--) {
+        slabs[i] = slabs[i - 1];
+    }
+    slabs[i] = slab;
+    nslabs++;
+    return slab;
+}
+
+static void
+slab_release(Slab *slab) {
+    Py_ssize_t i;
+
+    partial_remove(slab);
+    for (i = 0; slabs[i] != slab; i++) {
+    }
+    memmove(slabs + i, slabs + i + 1, (nslabs - i - 1) * sizeof(Slab *));
+    nslabs--;
+    PyMem_RawFree(slab->mem);
+    PyMem_RawFree(slab);
+}
+
+// スロットを 1 つ取り出して Custom として初期化する。GC にはまだ登録しない
+static CustomObject *
+arena_alloc(void) {
+    Slab *slab = cur_slab;
+    char *slot;
+
+    if (slab == NULL || (slab->free == NULL && slab->bump == (Py_ssize_t) SLAB_SLOTS)) {
+        if (partial != NULL) {
+            slab = partial;
+            partial_remove(slab);
+        } else {
+            slab = slab_new();
+            if (slab == NULL) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+        }
+        // 使い切った古い cur_slab はどのリストにも入れない。スロットが返されたら partial に戻る
+        cur_slab = slab;
+    }
+    if (slab->free != NULL) {
+        slot = slab->free;
+        slab->free = *(void **) slot;
+    } else {
+        slot = slab->mem + slab->bump++ * SLOT_SIZE;
+    }
+    slab->live++;
+    // GC ヘッダを 0 にしておくと「追跡されていない」状態になる
+    memset(slot, 0, SLOT_SIZE);
+    return (CustomObject *) PyObject_Init((PyObject *) (slot + CUSTOM_GC_PRESIZE), &CustomType);
+}
+
+static void
+arena_free(Slab *slab, void *op) {
+    char *slot = (char *) op - CUSTOM_GC_PRESIZE;
+
+    *(void **) slot = slab->free;
+    slab->free = slot;
+    slab->live--;
+    if (slab == cur_slab) {
+        return;
+    }
+    // 空になったスラブはすぐに返す
+    if (slab->live == 0) {
+        slab_release(slab);
+    } else if (!slab->in_partial) {
+        partial_push(slab);
+    }
+}
+
+// tp_alloc。アリーナモードのときだけ Custom をスラブから取る。サブクラスは自分の tp_alloc を使う
+static PyObject *
+Custom_alloc(PyTypeObject *type, Py_ssize_t nitems) {
+    if (arena_enabled && type == &CustomType) {
+        CustomObject *self = arena_alloc();
+        if (self == NULL) {
+            return NULL;
+        }
+        PyObject_GC_Track(self);
+        return (PyObject *) self;
+    }
+    return PyType_GenericAlloc(type, nitems);
+}
+
+// tp_free。スラブのものならスロットを返し、それ以外は通常どおり解放する
+static void
+Custom_free(void *op) {
+    Slab *slab = nslabs > 0 ? arena_find(op) : NULL;
+
+    if (slab != NULL) {
+        arena_free(slab, op);
+    } else {
+        PyObject_GC_Del(op);
+    }
+}
+
 
 static int
 Custom_traverse(CustomObject *self, visitproc visit, void *arg) {
@@ -31,6 +503,10 @@ Custom_traverse(CustomObject *self, visitproc visit, void *arg) {
 
 static int
 Custom_clear(CustomObject *self) {
+    intern_release(self->first, self->first_generation);
+    intern_release(self->last, self->last_generation);
+    self->first_generation = 0;
+    self->last_generation = 0;
     Py_CLEAR(self->first);
     // Py_CLEAR() が行うことはこれと同等
     // PyObject *tmp;
@@ -38,6 +514,8 @@ Custom_clear(CustomObject *self) {
     // self->first = NULL;
     // Py_XDECREF(tmp);
     Py_CLEAR(self->last);
+    // name はただの str で循環を作らないので traverse では辿らなくてよい
+    Py_CLEAR(self->name);
     return 0;
 }
 
@@ -47,6 +525,11 @@ Custom_dealloc(CustomObject *self) {
     PyObject_GC_UnTrack(self);
     // 循環GC起動してメンバをクリアする。
     Custom_clear(self);
+    // アントラックしたまま取っておく。使い回すときに追跡し直す
+    if (Py_IS_TYPE(self, &CustomType) && numfree < CUSTOM_MAXFREE) {
+        free_list[numfree++] = self;
+        return;
+    }
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -55,20 +538,27 @@ Custom_dealloc(CustomObject *self) {
 static PyObject *
 Custom_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
     CustomObject *self;
+    if (type == &CustomType && numfree > 0) {
+        // 参照カウントと型を初期化し直すだけで、メモリの確保は行わない
+        self = free_list[--numfree];
+        PyObject_Init((PyObject *) self, type);
+        Py_INCREF(empty_string);
+        self->first = empty_string;
+        Py_INCREF(empty_string);
+        self->last = empty_string;
+        self->number = 0;
+        // tp_alloc を通らないので GC への登録も自分で行う
+        PyObject_GC_Track(self);
+        return (PyObject *) self;
+    }
     // 失敗時は NULL
     // tp_alloc は PyType_Ready() がセットしている
     self = ((CustomObject *) type->tp_alloc(type, 0));
     if (self != NULL) {
-        self->first = PyUnicode_FromString("");
-        if (self->first == NULL) {
-            Py_DECREF(self);
-            return NULL;
-        }
-        self->last = PyUnicode_FromString("");
-        if (self->last == NULL) {
-            Py_DECREF(self);
-            return NULL;
-        }
+        Py_INCREF(empty_string);
+        self->first = empty_string;
+        Py_INCREF(empty_string);
+        self->last = empty_string;
         self->number = 0;
     }
     return (PyObject *) self;
@@ -79,7 +569,7 @@ Custom_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
 static int
 Custom_init(CustomObject *self, PyObject *args, PyObject *kwds) {
     static char *kwlist[] = {"first", "last", "number", NULL};
-    PyObject *first = NULL, *last = NULL, *tmp;
+    PyObject *first = NULL, *last = NULL;
     // first, last は文字列のみを許可する
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "|UUi", kwlist, &first, &last, &self->number)) {
         return -1;
@@ -87,16 +577,16 @@ Custom_init(CustomObject *self, PyObject *args, PyObject *kwds) {
     // tp_init は複数回呼び出しても良いので実装時には注意が必要
     // 逆に unpickle 時など呼ばれないこともあるのでこちらも注意が必要
     if (first) {
-        tmp = self->first;
-        Py_INCREF(first);
-        self->first = first;
-        Py_XDECREF(tmp);
+        if (intern_set(&self->first, &self->first_generation, first) < 0) {
+            return -1;
+        }
+        Py_CLEAR(self->name);
     }
     if (last) {
-        tmp = self->last;
-        Py_INCREF(last);
-        self->last = last;
-        Py_XDECREF(tmp);
+        if (intern_set(&self->last, &self->last_generation, last) < 0) {
+            return -1;
+        }
+        Py_CLEAR(self->name);
     }
     return 0;
 }
@@ -115,7 +605,6 @@ Custom_getfirst(CustomObject *self, void *closure) {
 
 static int
 Custom_setfirst(CustomObject *self, PyObject *value, void *closure) {
-    PyObject *tmp;
     // del 時に NULL が渡されてくる
     if (value == NULL) {
         PyErr_SetString(PyExc_AttributeError, "Cannnot delete the first attribute");
@@ -125,10 +614,10 @@ Custom_setfirst(CustomObject *self, PyObject *value, void *closure) {
         PyErr_SetString(PyExc_AttributeError, "The first attribute value must be a string");
         return -1;
     }
-    tmp = self->first;
-    Py_INCREF(value);
-    self->first = value;
-    Py_DECREF(tmp);
+    if (intern_set(&self->first, &self->first_generation, value) < 0) {
+        return -1;
+    }
+    Py_CLEAR(self->name);
     return 0;
 }
 
@@ -140,7 +629,6 @@ Custom_getlast(CustomObject *self, void *closure) {
 
 static int
 Custom_setlast(CustomObject *self, PyObject *value, void *closure) {
-    PyObject *tmp;
     if (value == NULL) {
         PyErr_SetString(PyExc_AttributeError, "Cannnot delete the last attribute");
         return -1;
@@ -149,10 +637,10 @@ Custom_setlast(CustomObject *self, PyObject *value, void *closure) {
         PyErr_SetString(PyExc_AttributeError, "The last attribute value must be a string");
         return -1;
     }
-    tmp = self->last;
-    Py_INCREF(value);
-    self->last = value;
-    Py_DECREF(tmp);
+    if (intern_set(&self->last, &self->last_generation, value) < 0) {
+        return -1;
+    }
+    Py_CLEAR(self->name);
     return 0;
 }
 
@@ -173,11 +661,89 @@ Custom_name(CustomObject *self, PyObject *Py_UNUSED(ignored)) {
         PyErr_SetString(PyExc_AttributeError, "last");
         return NULL;
     }
-    return PyUnicode_FromFormat("%S %S", self->first, self->last);
+    if (self->name == NULL) {
+        PyObject *name = PyUnicode_FromFormat("%S %S", self->first, self->last);
+        if (name == NULL) {
+            return NULL;
+        }
+        // str のサブクラスは __str__ が毎回同じ結果を返すとは限らないのでキャッシュしない
+        if (!PyUnicode_CheckExact(self->first) || !PyUnicode_CheckExact(self->last)) {
+            return name;
+        }
+        self->name = name;
+    }
+    Py_INCREF(self->name);
+    return self->name;
+}
+
+// Custom.allocate_batch(n, first='', last='', number=0)
+// n 個の Custom をまとめて作ってリストで返す。Custom 自身ならアリーナモードでなくてもスラブから切り出す
+static PyObject *
+Custom_allocate_batch(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"n", "first", "last", "number", NULL};
+    Py_ssize_t n, i;
+    PyObject *first = empty_string, *last = empty_string, *list;
+    int number = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|UUi", kwlist, &n, &first, &last, &number)) {
+        return NULL;
+    }
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "n must be non-negative");
+        return NULL;
+    }
+    first = intern_name(first);
+    if (first == NULL) {
+        return NULL;
+    }
+    last = intern_name(last);
+    if (last == NULL) {
+        Py_DECREF(first);
+        return NULL;
+    }
+    list = PyList_New(n);
+    if (list == NULL) {
+        Py_DECREF(first);
+        Py_DECREF(last);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        CustomObject *self;
+        if (type == &CustomType && arena_usable) {
+            self = arena_alloc();
+            if (self != NULL) {
+                PyObject_GC_Track(self);
+            }
+        } else {
+            self = (CustomObject *) type->tp_alloc(type, 0);
+        }
+        if (self == NULL) {
+            Py_DECREF(first);
+            Py_DECREF(last);
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, (PyObject *) self);
+        self->number = number;
+        // 先に intern_name() を通しているので、表を引いてもすぐに同じオブジェクトが見つかる
+        if (intern_set(&self->first, &self->first_generation, first) < 0
+            || intern_set(&self->last, &self->last_generation, last) < 0) {
+            Py_DECREF(first);
+            Py_DECREF(last);
+            Py_DECREF(list);
+            return NULL;
+        }
+    }
+    Py_DECREF(first);
+    Py_DECREF(last);
+    return list;
 }
 
 static PyMethodDef Custom_methods[] = {
         {"name", (PyCFunction) Custom_name, METH_NOARGS, "Return the name, combining the first and last name"},
+        {"allocate_batch", (PyCFunction) (void (*)(void)) Custom_allocate_batch, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+         "allocate_batch(n, first='', last='', number=0)\n"
+         "Return a list of n new objects. Custom instances are carved from contiguous slabs"},
         {NULL}
 };
 
@@ -198,6 +764,460 @@ static PyTypeObject CustomType = {
         .tp_members = Custom_members,
         .tp_methods = Custom_methods,
         .tp_getset = Custom_getsetters,
+        .tp_alloc = Custom_alloc,
+        .tp_free = Custom_free,
+};
+
+// ---- CustomBatch ----
+// 大量のレコードを Custom のリストで持つと、1 件ごとに Custom 本体と str 2 つが必要で GC の追跡対象も増える
+// CustomBatch は first, last, number を列ごとの連続した配列に詰めて持ち、
+// 添字でアクセスされたときに初めて Custom を作る
+// 文字列の列は UTF-8 のバイト列を連結したものと、各要素の開始位置の配列で表す
+// i 番目の要素は data[offsets[i]:offsets[i + 1]]
+
+typedef struct {
+    char *data;
+    Py_ssize_t used;
+    Py_ssize_t alloc;
+    Py_ssize_t *offsets;  // 長さは len + 1。offsets[0] は常に 0
+} StringColumn;
+
+typedef struct {
+    PyObject ob_base;
+    Py_ssize_t len;
+    Py_ssize_t alloc;  // numbers と offsets に確保済みの要素数
+    StringColumn first;
+    StringColumn last;
+    int32_t *numbers;
+} CustomBatchObject;
+
+static PyTypeObject CustomBatchType;
+
+// offsets を n 要素分確保する
+static int
+column_reserve_items(StringColumn *col, Py_ssize_t n) {
+    Py_ssize_t *offsets = PyMem_Realloc(col->offsets, (n + 1) * sizeof(Py_ssize_t));
+    if (offsets == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (col->offsets == NULL) {
+        offsets[0] = 0;
+    }
+    col->offsets = offsets;
+    return 0;
+}
+
+// data に size バイトを追加できるようにする
+static int
+column_reserve_bytes(StringColumn *col, Py_ssize_t size) {
+    Py_ssize_t alloc;
+    char *data;
+
+    if (col->alloc - col->used >= size) {
+        return 0;
+    }
+    alloc = col->alloc ? col->alloc : 256;
+    while (alloc - col->used < size) {
+        if (alloc > PY_SSIZE_T_MAX / 2) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        alloc *= 2;
+    }
+    data = PyMem_Realloc(col->data, alloc);
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    col->data = data;
+    col->alloc = alloc;
+    return 0;
+}
+
+static void
+column_free(StringColumn *col) {
+    PyMem_Free(col->data);
+    PyMem_Free(col->offsets);
+    memset(col, 0, sizeof(*col));
+}
+
+static PyObject *
+column_get(StringColumn *col, Py_ssize_t i) {
+    return PyUnicode_DecodeUTF8(col->data + col->offsets[i], col->offsets[i + 1] - col->offsets[i], NULL);
+}
+
+// n 件を追加できるようにする
+static int
+CustomBatch_reserve(CustomBatchObject *self, Py_ssize_t n) {
+    Py_ssize_t alloc;
+    int32_t *numbers;
+
+    if (self->alloc - self->len >= n) {
+        return 0;
+    }
+    alloc = self->alloc ? self->alloc : 16;
+    while (alloc - self->len < n) {
+        if (alloc > PY_SSIZE_T_MAX / 2 / (Py_ssize_t) sizeof(Py_ssize_t)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        alloc *= 2;
+    }
+    numbers = PyMem_Realloc(self->numbers, alloc * sizeof(int32_t));
+    if (numbers == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->numbers = numbers;
+    if (column_reserve_items(&self->first, alloc) < 0 || column_reserve_items(&self->last, alloc) < 0) {
+        return -1;
+    }
+    self->alloc = alloc;
+    return 0;
+}
+
+// 1 件追加する。first, last は str であること
+// 途中で失敗しても中身は変わらない
+static int
+CustomBatch_push(CustomBatchObject *self, PyObject *first, PyObject *last, int number) {
+    const char *f, *l;
+    Py_ssize_t flen, llen, n = self->len;
+
+    f = PyUnicode_AsUTF8AndSize(first, &flen);
+    if (f == NULL) {
+        return -1;
+    }
+    l = PyUnicode_AsUTF8AndSize(last, &llen);
+    if (l == NULL) {
+        return -1;
+    }
+    if (CustomBatch_reserve(self, 1) < 0
+        || column_reserve_bytes(&self->first, flen) < 0
+        || column_reserve_bytes(&self->last, llen) < 0) {
+        return -1;
+    }
+    memcpy(self->first.data + self->first.used, f, flen);
+    self->first.used += flen;
+    self->first.offsets[n + 1] = self->first.used;
+    memcpy(self->last.data + self->last.used, l, llen);
+    self->last.used += llen;
+    self->last.offsets[n + 1] = self->last.used;
+    self->numbers[n] = number;
+    self->len = n + 1;
+    return 0;
+}
+
+// Custom または (first, last, number) のタプルを 1 件追加する
+static int
+CustomBatch_push_item(CustomBatchObject *self, PyObject *item) {
+    PyObject *first, *last = empty_string;
+    int number = 0;
+
+    if (PyObject_TypeCheck(item, &CustomType)) {
+        CustomObject *c = (CustomObject *) item;
+        // GC にクリアされた後の Custom は first, last が NULL のことがある
+        if (c->first == NULL || c->last == NULL) {
+            PyErr_SetString(PyExc_AttributeError, c->first == NULL ? "first" : "last");
+            return -1;
+        }
+        return CustomBatch_push(self, c->first, c->last, c->number);
+    }
+    if (!PyTuple_Check(item)) {
+        PyErr_Format(PyExc_TypeError, "expected a Custom or a (first, last, number) tuple, not %.200s",
+                     Py_TYPE(item)->tp_name);
+        return -1;
+    }
+    if (!PyArg_ParseTuple(item, "U|Ui:CustomBatch item", &first, &last, &number)) {
+        return -1;
+    }
+    return CustomBatch_push(self, first, last, number);
+}
+
+static void
+CustomBatch_clear_columns(CustomBatchObject *self) {
+    column_free(&self->first);
+    column_free(&self->last);
+    PyMem_Free(self->numbers);
+    self->numbers = NULL;
+    self->len = 0;
+    self->alloc = 0;
+}
+
+static void
+CustomBatch_dealloc(CustomBatchObject *self) {
+    CustomBatch_clear_columns(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// CustomBatch.extend(iterable)
+static PyObject *
+CustomBatch_extend(CustomBatchObject *self, PyObject *iterable) {
+    PyObject *it, *item;
+
+    // CustomBatch 同士は列をそのままつなげる
+    if (PyObject_TypeCheck(iterable, &CustomBatchType)) {
+        CustomBatchObject *other = (CustomBatchObject *) iterable;
+        Py_ssize_t i, n = other->len, base = self->len;
+        Py_ssize_t fbase = self->first.used, lbase = self->last.used;
+
+        if (n == 0) {
+            Py_RETURN_NONE;
+        }
+        if (CustomBatch_reserve(self, n) < 0
+            || column_reserve_bytes(&self->first, other->first.used) < 0
+            || column_reserve_bytes(&self->last, other->last.used) < 0) {
+            return NULL;
+        }
+        // self と other が同じでも、先に長さを読んでおけば自分自身を 2 倍にするだけになる
+        memcpy(self->first.data + fbase, other->first.data, other->first.used);
+        memcpy(self->last.data + lbase, other->last.data, other->last.used);
+        memcpy(self->numbers + base, other->numbers, n * sizeof(int32_t));
+        for (i = 1; i <= n; i++) {
+            self->first.offsets[base + i] = fbase + other->first.offsets[i];
+            self->last.offsets[base + i] = lbase + other->last.offsets[i];
+        }
+        self->first.used = fbase + other->first.offsets[n];
+        self->last.used = lbase + other->last.offsets[n];
+        self->len = base + n;
+        Py_RETURN_NONE;
+    }
+    it = PyObject_GetIter(iterable);
+    if (it == NULL) {
+        return NULL;
+    }
+    while ((item = PyIter_Next(it)) != NULL) {
+        int r = CustomBatch_push_item(self, item);
+        Py_DECREF(item);
+        if (r < 0) {
+            Py_DECREF(it);
+            return NULL;
+        }
+    }
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// __init__(iterable=()) になる。list と同じく呼び直すと中身を入れ替える
+static int
+CustomBatch_init(CustomBatchObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"iterable", NULL};
+    PyObject *iterable = NULL, *r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:CustomBatch", kwlist, &iterable)) {
+        return -1;
+    }
+    CustomBatch_clear_columns(self);
+    if (iterable == NULL) {
+        return 0;
+    }
+    r = CustomBatch_extend(self, iterable);
+    if (r == NULL) {
+        return -1;
+    }
+    Py_DECREF(r);
+    return 0;
+}
+
+// CustomBatch.append(item)
+static PyObject *
+CustomBatch_append(CustomBatchObject *self, PyObject *item) {
+    if (CustomBatch_push_item(self, item) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+CustomBatch_length(CustomBatchObject *self) {
+    return self->len;
+}
+
+// 添字アクセスのたびに新しい Custom を作る。負の添字は PySequence_GetItem() が直してくれる
+static PyObject *
+CustomBatch_item(CustomBatchObject *self, Py_ssize_t i) {
+    CustomObject *obj;
+    PyObject *first, *last;
+
+    if (i < 0 || i >= self->len) {
+        PyErr_SetString(PyExc_IndexError, "CustomBatch index out of range");
+        return NULL;
+    }
+    first = column_get(&self->first, i);
+    if (first == NULL) {
+        return NULL;
+    }
+    last = column_get(&self->last, i);
+    if (last == NULL) {
+        Py_DECREF(first);
+        return NULL;
+    }
+    obj = (CustomObject *) Custom_new(&CustomType, NULL, NULL);
+    if (obj == NULL) {
+        Py_DECREF(first);
+        Py_DECREF(last);
+        return NULL;
+    }
+    obj->number = self->numbers[i];
+    if (intern_set(&obj->first, &obj->first_generation, first) < 0
+        || intern_set(&obj->last, &obj->last_generation, last) < 0) {
+        Py_DECREF(obj);
+        obj = NULL;
+    }
+    Py_DECREF(first);
+    Py_DECREF(last);
+    return (PyObject *) obj;
+}
+
+// 列に確保しているバイト数
+static Py_ssize_t
+CustomBatch_allocated(CustomBatchObject *self) {
+    Py_ssize_t n = 0;
+
+    if (self->alloc > 0) {
+        n += self->alloc * (Py_ssize_t) sizeof(int32_t);
+        n += 2 * (self->alloc + 1) * (Py_ssize_t) sizeof(Py_ssize_t);
+    }
+    return n + self->first.alloc + self->last.alloc;
+}
+
+static PyObject *
+CustomBatch_getnbytes(CustomBatchObject *self, void *closure) {
+    return PyLong_FromSsize_t(CustomBatch_allocated(self));
+}
+
+static PyObject *
+CustomBatch_sizeof(CustomBatchObject *self, PyObject *Py_UNUSED(ignored)) {
+    return PyLong_FromSsize_t(Py_TYPE(self)->tp_basicsize + CustomBatch_allocated(self));
+}
+
+static PySequenceMethods CustomBatch_as_sequence = {
+        .sq_length = (lenfunc) CustomBatch_length,
+        .sq_item = (ssizeargfunc) CustomBatch_item,
+};
+
+static PyGetSetDef CustomBatch_getsetters[] = {
+        {"nbytes", (getter) CustomBatch_getnbytes, NULL, "bytes allocated for the columns", NULL},
+        {NULL}
+};
+
+static PyMethodDef CustomBatch_methods[] = {
+        {"append", (PyCFunction) CustomBatch_append, METH_O,
+         "append(item)\n"
+         "Append a Custom or a (first, last, number) tuple"},
+        {"extend", (PyCFunction) CustomBatch_extend, METH_O,
+         "extend(iterable)\n"
+         "Append every item of iterable. Another CustomBatch is copied column by column"},
+        {"__sizeof__", (PyCFunction) CustomBatch_sizeof, METH_NOARGS, "Size of the object in memory, in bytes"},
+        {NULL}
+};
+
+// 中身は C の配列だけで Python オブジェクトを持たないので GC の対象にしない
+static PyTypeObject CustomBatchType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "custom4.CustomBatch",
+        .tp_doc = "CustomBatch(iterable=())\n"
+                  "Columnar container of Custom records. "
+                  "Items are stored as UTF-8 and int32 columns and turned into Custom objects on access",
+        .tp_basicsize = sizeof(CustomBatchObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_new = PyType_GenericNew,
+        .tp_init = (initproc) CustomBatch_init,
+        .tp_dealloc = (destructor) CustomBatch_dealloc,
+        .tp_as_sequence = &CustomBatch_as_sequence,
+        .tp_methods = CustomBatch_methods,
+        .tp_getset = CustomBatch_getsetters,
+};
+
+// 取っておいた Custom をすべて解放し、その数を返す
+static PyObject *
+clear_freelist(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    int n = numfree;
+    while (numfree > 0) {
+        CustomObject *op = free_list[--numfree];
+        CustomType.tp_free((PyObject *) op);
+    }
+    return PyLong_FromLong(n);
+}
+
+// set_arena(enabled) -> 以前の設定
+static PyObject *
+set_arena(PyObject *self, PyObject *arg) {
+    int enabled = PyObject_IsTrue(arg);
+    int previous = arena_enabled;
+
+    if (enabled < 0) {
+        return NULL;
+    }
+    if (enabled && !arena_usable) {
+        PyErr_SetString(PyExc_RuntimeError, "the slab arena is not supported by this Python build");
+        return NULL;
+    }
+    arena_enabled = enabled;
+    return PyBool_FromLong(previous);
+}
+
+static PyObject *
+arena_stats(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_ssize_t i, live = 0;
+
+    for (i = 0; i < nslabs; i++) {
+        live += slabs[i]->live;
+    }
+    return Py_BuildValue("{s:O,s:O,s:n,s:n,s:n,s:n}",
+                         "usable", arena_usable ? Py_True : Py_False,
+                         "enabled", arena_enabled ? Py_True : Py_False,
+                         "slabs", nslabs,
+                         "slot_size", (Py_ssize_t) SLOT_SIZE,
+                         "capacity", nslabs * (Py_ssize_t) SLAB_SLOTS,
+                         "live", live);
+}
+
+// GC ヘッダの大きさが想定どおりかを sys.getsizeof() で確かめる
+// getsizeof() は GC 対象のオブジェクトにはヘッダの分を足して返す
+static int
+arena_probe(void) {
+    PyObject *sys, *obj, *size;
+    Py_ssize_t n;
+
+    sys = PyImport_ImportModule("sys");
+    if (sys == NULL) {
+        return -1;
+    }
+    obj = PyObject_CallNoArgs((PyObject *) &CustomType);
+    if (obj == NULL) {
+        Py_DECREF(sys);
+        return -1;
+    }
+    size = PyObject_CallMethod(sys, "getsizeof", "O", obj);
+    Py_DECREF(obj);
+    Py_DECREF(sys);
+    if (size == NULL) {
+        return -1;
+    }
+    n = PyLong_AsSsize_t(size);
+    Py_DECREF(size);
+    if (n == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    arena_usable = n == (Py_ssize_t) (sizeof(CustomObject) + CUSTOM_GC_PRESIZE);
+    return 0;
+}
+
+static PyMethodDef custom_methods[] = {
+        {"clear_freelist", clear_freelist, METH_NOARGS, "Free the Custom objects kept for reuse and return how many there were"},
+        {"set_arena", set_arena, METH_O, "Make Custom() allocate from the slab arena or not. Returns the previous setting"},
+        {"arena_stats", arena_stats, METH_NOARGS, "Return a dict describing the slab arena"},
+        {"set_interning", set_interning, METH_O,
+         "Share one str object between equal first/last names. Returns the previous setting"},
+        {"intern_stats", intern_stats, METH_NOARGS, "Return a dict describing the name interning table"},
+        {"intern_purge", intern_purge, METH_NOARGS,
+         "Drop interned names no Custom object uses any more. Returns the number dropped"},
+        {NULL, NULL, 0, NULL},
 };
 
 // https://docs.python.org/ja/3/c-api/module.html#c.PyModuleDef
@@ -206,6 +1226,7 @@ static PyModuleDef custommodule = {
         .m_name = "custom4",
         .m_doc = "Example module that creates an extension type.",
         .m_size = -1,
+        .m_methods = custom_methods,
 };
 
 PyMODINIT_FUNC
@@ -215,6 +1236,18 @@ PyInit_custom4(void) {
     if (PyType_Ready(&CustomType) > 0) {
         return NULL;
     }
+    if (PyType_Ready(&CustomBatchType) < 0) {
+        return NULL;
+    }
+    if (empty_string == NULL) {
+        empty_string = PyUnicode_FromString("");
+        if (empty_string == NULL) {
+            return NULL;
+        }
+    }
+    if (arena_probe() < 0) {
+        return NULL;
+    }
     m = PyModule_Create(&custommodule);
     if (m == NULL)
         return NULL;
@@ -224,6 +1257,12 @@ PyInit_custom4(void) {
         Py_DECREF(m);
         return NULL;
     }
+    Py_INCREF(&CustomBatchType);
+    if (PyModule_AddObject(m, "CustomBatch", (PyObject *) &CustomBatchType) < 0) {
+        Py_DECREF(&CustomBatchType);
+        Py_DECREF(m);
+        return NULL;
+    }
     return m;
 }
 
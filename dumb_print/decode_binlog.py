@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Render a dumb_print.BinaryLog stream as text.
+
+usage: decode_binlog.py [--timestamps] [FILE ...]
+
+Reads FILE (or stdin) and prints one line per record, formatting each
+log record with str.format() and the template registered for its id.
+A truncated record at the end of the stream, as left by a crash, is
+ignored.
+"""
+
+import argparse
+import datetime
+import struct
+import sys
+
+MAGIC = b"DPBLOG1\n"
+
+
+class Truncated(Exception):
+    pass
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise Truncated()
+        chunk = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return chunk
+
+    def unpack(self, fmt):
+        return struct.unpack(fmt, self.take(struct.calcsize(fmt)))
+
+    def blob(self):
+        (n,) = self.unpack("<I")
+        return self.take(n)
+
+    def arg(self):
+        tag = self.take(1)
+        if tag == b"i":
+            return self.unpack("<q")[0]
+        if tag == b"d":
+            return self.unpack("<d")[0]
+        if tag == b"?":
+            return bool(self.take(1)[0])
+        if tag == b"n":
+            return None
+        if tag == b"s":
+            return self.blob().decode("utf-8", "replace")
+        if tag == b"b":
+            return self.blob()
+        if tag == b"I":
+            return int(self.blob())
+        raise ValueError("unknown argument tag %r at offset %d" % (tag, self.pos - 1))
+
+
+def decode(data, timestamps=False):
+    """Yield the text of every record in data."""
+    r = Reader(data)
+    formats = {}
+    try:
+        while r.pos < len(data):
+            if data.startswith(MAGIC, r.pos):
+                # BinaryLog を作り直すと ID は 0 から振り直される
+                r.pos += len(MAGIC)
+                formats = {}
+                continue
+            kind = r.take(1)
+            if kind == b"F":
+                (fid,) = r.unpack("<I")
+                formats[fid] = r.blob().decode("utf-8", "replace")
+            elif kind == b"T":
+                yield r.blob().decode("utf-8", "replace")
+            elif kind == b"L":
+                fid, ns, nargs = r.unpack("<IQB")
+                args = [r.arg() for _ in range(nargs)]
+                fmt = formats.get(fid)
+                if fmt is None:
+                    text = "<unknown format id %d> %r" % (fid, args)
+                else:
+                    try:
+                        text = fmt.format(*args)
+                    except (IndexError, KeyError, ValueError) as e:
+                        text = "<bad record for %r: %s> %r" % (fmt, e, args)
+                if timestamps:
+                    when = datetime.datetime.fromtimestamp(ns // 1000000000)
+                    text = "%s.%09d %s" % (when.isoformat(), ns % 1000000000, text)
+                yield text
+            else:
+                raise ValueError("unknown record type %r at offset %d" % (kind, r.pos - 1))
+    except Truncated:
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Render a dumb_print.BinaryLog stream as text.")
+    parser.add_argument("files", nargs="*", metavar="FILE")
+    parser.add_argument("--timestamps", action="store_true", help="prefix each log record with its time")
+    args = parser.parse_args()
+
+    sources = args.files or ["-"]
+    out = sys.stdout
+    for name in sources:
+        if name == "-":
+            data = sys.stdin.buffer.read()
+        else:
+            with open(name, "rb") as f:
+                data = f.read()
+        for line in decode(data, args.timestamps):
+            out.write(line)
+            out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
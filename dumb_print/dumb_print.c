@@ -1,17 +1,3264 @@
+#define PY_SSIZE_T_CLEAN
+
 #include <Python.h>
+#include "structmember.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static PyObject *
+dumb_print(PyObject *self, PyObject *args) {
+    const char *text;
+    if (!PyArg_ParseTuple(args, "s", &text)) {
+        return NULL;
+    }
+    printf("%s\n", text);
+    Py_RETURN_NONE;
+}
+
+// fd に len バイトすべてを書き込む。GIL を解放した状態で呼ぶ。失敗時は errno を返す
+static int
+write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// iov をすべて書き終えるまで writev する。部分書き込みなら iov を進めて続ける
+// GIL を解放した状態で呼ぶ。失敗時は errno を返す
+static int
+writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// これより大きいデータを書くときだけ GIL を手放す。小さいものは GIL の受け渡しの方が高くつく
+#define RELEASE_GIL_THRESHOLD (64 * 1024)
+
+static PyObject *
+dumb_print_bytes(PyObject *self, PyObject *args) {
+    Py_buffer data;
+    struct iovec iov[2];
+    int err;
+
+    // バッファプロトコルを持つものなら bytes でも memoryview でもそのまま書き出す
+    if (!PyArg_ParseTuple(args, "y*", &data)) {
+        return NULL;
+    }
+    iov[0].iov_base = data.buf;
+    iov[0].iov_len = data.len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    fflush(stdout);
+    if (data.len >= RELEASE_GIL_THRESHOLD) {
+        Py_BEGIN_ALLOW_THREADS
+        err = writev_all(STDOUT_FILENO, iov, 2);
+        Py_END_ALLOW_THREADS
+    } else {
+        err = writev_all(STDOUT_FILENO, iov, 2);
+    }
+    PyBuffer_Release(&data);
+    if (err != 0) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+dumb_print_many(PyObject *self, PyObject *iterable) {
+    // 1 行につき本文と改行の 2 つを使う
+    struct iovec iov[IOV_MAX];
+    static char newline[] = "\n";
+    PyObject *it, *seq;
+    Py_ssize_t n, i;
+    int count = 0, err = 0;
+
+    // str は seq が参照を持っている間は不変なので、UTF-8 表現のポインタをそのまま渡せる
+    // PySequence_Fast() は list をそのまま返し、GIL を手放している間に別スレッドが中身を消しうるので
+    // 必ずタプルに写して参照を持っておく
+    it = PyObject_GetIter(iterable);
+    if (it == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+            PyErr_SetString(PyExc_TypeError, "print_many() argument must be iterable");
+        }
+        return NULL;
+    }
+    seq = PySequence_Tuple(it);
+    Py_DECREF(it);
+    if (seq == NULL) {
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(seq);
+    // print() の printf と順番が入れ替わらないように stdio のバッファを先に出す
+    fflush(stdout);
+    for (i = 0; i < n; i++) {
+        PyObject *item = PyTuple_GET_ITEM(seq, i);
+        Py_ssize_t len;
+        const char *text;
+
+        if (!PyUnicode_Check(item)) {
+            PyErr_Format(PyExc_TypeError, "print_many() items must be str, not %.200s", Py_TYPE(item)->tp_name);
+            break;
+        }
+        text = PyUnicode_AsUTF8AndSize(item, &len);
+        if (text == NULL) {
+            break;
+        }
+        iov[count].iov_base = (void *) text;
+        iov[count].iov_len = len;
+        iov[count + 1].iov_base = newline;
+        iov[count + 1].iov_len = 1;
+        count += 2;
+        if (count + 2 > IOV_MAX) {
+            Py_BEGIN_ALLOW_THREADS
+            err = writev_all(STDOUT_FILENO, iov, count);
+            Py_END_ALLOW_THREADS
+            count = 0;
+            if (err != 0) {
+                break;
+            }
+        }
+    }
+    // 例外が起きた場合もそれまでの行は出力しておく
+    if (count > 0 && err == 0) {
+        Py_BEGIN_ALLOW_THREADS
+        err = writev_all(STDOUT_FILENO, iov, count);
+        Py_END_ALLOW_THREADS
+    }
+    Py_DECREF(seq);
+    if (err != 0 && !PyErr_Occurred()) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// ---- Writer ----
+// stdio を通さず自前のバッファに行を溜め、いっぱいになったら write(2) 1 回で書き出す
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int fd;
+    char *buf;
+    Py_ssize_t bufsize;
+    Py_ssize_t pending;  // buf に溜まっているバイト数
+    int closed;
+    PyThread_type_lock lock;  // write(2) の間は GIL を手放すので、バッファはこのロックで守る
+} WriterObject;
+
+static void
+Writer_lock(WriterObject *self) {
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+// ロックを持った状態で閉じていないか確かめる。Writer_check() はロックの外で見ているので、
+// ロックを待つ間に別スレッドが close() していることがある
+static int
+Writer_check_locked(WriterObject *self) {
+    if (self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed Writer");
+        return -1;
+    }
+    return 0;
+}
+
+// ロックを持った状態で呼ぶ。失敗時は例外をセットして -1
+static int
+Writer_flush_locked(WriterObject *self) {
+    int err;
+
+    if (Writer_check_locked(self) < 0) {
+        return -1;
+    }
+    if (self->pending == 0) {
+        return 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = write_all(self->fd, self->buf, self->pending);
+    Py_END_ALLOW_THREADS
+    // 途中まで書けていても残りは捨てる。再送すると行が重複するため
+    self->pending = 0;
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+// data を len バイト追記する。溜まったら書き出し、バッファより大きいものは直接書く
+static int
+Writer_append_locked(WriterObject *self, const char *data, Py_ssize_t len) {
+    int err;
+
+    if (Writer_check_locked(self) < 0) {
+        return -1;
+    }
+    if (self->pending + len > self->bufsize && Writer_flush_locked(self) < 0) {
+        return -1;
+    }
+    if (len > self->bufsize) {
+        Py_BEGIN_ALLOW_THREADS
+        err = write_all(self->fd, data, len);
+        Py_END_ALLOW_THREADS
+        if (err != 0) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        return 0;
+    }
+    memcpy(self->buf + self->pending, data, len);
+    self->pending += len;
+    return 0;
+}
+
+static void
+Writer_dealloc(WriterObject *self) {
+    if (self->lock != NULL) {
+        if (!self->closed && self->buf != NULL) {
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            Writer_lock(self);
+            if (Writer_flush_locked(self) < 0) {
+                PyErr_WriteUnraisable((PyObject *) self);
+            }
+            PyThread_release_lock(self->lock);
+            PyErr_Restore(type, value, tb);
+        }
+        PyThread_free_lock(self->lock);
+    }
+    PyMem_Free(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Writer_init(WriterObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fd", "bufsize", NULL};
+    int fd = 1;
+    Py_ssize_t bufsize = 1 << 20;
+    char *buf;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|in", kwlist, &fd, &bufsize)) {
+        return -1;
+    }
+    if (fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "fd must be non-negative");
+        return -1;
+    }
+    if (bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return -1;
+    }
+    if (self->lock == NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "cannot allocate lock");
+            return -1;
+        }
+    }
+    buf = PyMem_Malloc(bufsize);
+    if (buf == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    // __init__ が再度呼ばれた場合は前のバッファを書き出してから差し替える
+    Writer_lock(self);
+    if (self->buf != NULL && !self->closed && Writer_flush_locked(self) < 0) {
+        PyThread_release_lock(self->lock);
+        PyMem_Free(buf);
+        return -1;
+    }
+    PyMem_Free(self->buf);
+    self->buf = buf;
+    self->bufsize = bufsize;
+    self->pending = 0;
+    self->fd = fd;
+    self->closed = 0;
+    PyThread_release_lock(self->lock);
+    return 0;
+}
+
+static int
+Writer_check(WriterObject *self) {
+    if (self->buf == NULL || self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed Writer");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+Writer_print(WriterObject *self, PyObject *args) {
+    const char *text;
+    Py_ssize_t len;
+    int r;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
+        return NULL;
+    }
+    if (Writer_check(self) < 0) {
+        return NULL;
+    }
+    Writer_lock(self);
+    r = Writer_append_locked(self, text, len);
+    if (r == 0) {
+        r = Writer_append_locked(self, "\n", 1);
+    }
+    PyThread_release_lock(self->lock);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Writer_flush(WriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    int r;
+
+    if (Writer_check(self) < 0) {
+        return NULL;
+    }
+    Writer_lock(self);
+    r = Writer_flush_locked(self);
+    PyThread_release_lock(self->lock);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Writer_close(WriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    int r = 0;
+
+    if (self->buf == NULL || self->closed) {
+        Py_RETURN_NONE;
+    }
+    Writer_lock(self);
+    // ロックを待つ間に別スレッドが閉じていれば何もしない
+    if (!self->closed) {
+        r = Writer_flush_locked(self);
+    }
+    // fd は呼び出し元のものなので閉じない
+    self->closed = 1;
+    PyThread_release_lock(self->lock);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Writer_enter(WriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (Writer_check(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+Writer_exit(WriterObject *self, PyObject *args) {
+    return Writer_close(self, NULL);
+}
+
+static PyMethodDef Writer_methods[] = {
+    {"print", (PyCFunction) Writer_print, METH_VARARGS, "Append text and a newline to the buffer"},
+    {"flush", (PyCFunction) Writer_flush, METH_NOARGS, "Write the buffered lines with a single write(2)"},
+    {"close", (PyCFunction) Writer_close, METH_NOARGS, "Flush and stop accepting lines. The fd is left open"},
+    {"__enter__", (PyCFunction) Writer_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) Writer_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef Writer_members[] = {
+    {"fd", T_INT, offsetof(WriterObject, fd), READONLY, "file descriptor written to"},
+    {"bufsize", T_PYSSIZET, offsetof(WriterObject, bufsize), READONLY, "buffer size in bytes"},
+    {"pending", T_PYSSIZET, offsetof(WriterObject, pending), READONLY, "bytes waiting in the buffer"},
+    {NULL},
+};
+
+static PyTypeObject WriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.Writer",
+    .tp_doc = "Writer(fd=1, bufsize=1048576)\n"
+              "Buffered line writer that bypasses stdio and issues one write(2) per full buffer.",
+    .tp_basicsize = sizeof(WriterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Writer_init,
+    .tp_dealloc = (destructor) Writer_dealloc,
+    .tp_methods = Writer_methods,
+    .tp_members = Writer_members,
+};
+
+// ---- AsyncWriter ----
+// 呼び出し側は str/bytes への参照をリングに積むだけで、書き出しは専用のネイティブスレッドが行う
+// リングは Vyukov の bounded queue。各スロットの seq で「空き」「書き込み済み」を表す
+//   seq == pos            : pos 番目の書き込み待ち（空き）
+//   seq == pos + 1        : pos 番目が積まれて読み出し待ち
+//   seq == pos + capacity : 書き出し完了。次の周回の pos + capacity 番目で再利用できる
+// 書き出しスレッドは GIL を持たないので参照カウントに触れない
+// 使い終わったオブジェクトはスロットを再利用するプロデューサ（GIL を持っている）が DECREF する
+
+enum {
+    POLICY_BLOCK,  // 空くまで待つ
+    POLICY_DROP,   // 捨てる
+    POLICY_COUNT,  // 捨てて、次に書けたときに捨てた行数を 1 行出力する
+};
+
+static const char *const policy_names[] = {"block", "drop", "count"};
+
+typedef struct {
+    atomic_size_t seq;
+    PyObject *obj;  // data の持ち主。スロットが再利用されるまで参照を持ち続ける
+    const char *data;
+    Py_ssize_t len;
+} AsyncSlot;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int fd;
+    int policy;
+    Py_ssize_t capacity;
+    size_t mask;
+    AsyncSlot *slots;
+    int started;
+    int closed;
+    size_t spin;  // 書き出しスレッドが寝る前に空回りする回数
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;  // 書き出しスレッドが待つ
+    pthread_cond_t progress;   // ブロック中のプロデューサと flush() が待つ
+    atomic_int sleeping;       // 書き出しスレッドが not_empty で待っている
+    atomic_int waiters;        // progress で待っているスレッド数
+    atomic_int stop;
+    atomic_int error;          // 書き出しスレッドで起きた最初のエラーの errno
+    atomic_size_t dropped;
+    atomic_size_t pending_drops;  // まだ出力していない捨てた行数（count ポリシー用）
+    atomic_size_t high_water;
+    // プロデューサと書き出しスレッドがそれぞれ更新する位置は別のキャッシュラインに置く
+    char pad0[64];
+    atomic_size_t enqueue_pos;
+    char pad1[64];
+    atomic_size_t written_pos;  // 書き出しスレッドだけが更新する
+    char pad2[64];
+} AsyncWriterObject;
+
+// pos 番目のスロットが積まれていれば 1
+static int
+AsyncWriter_ready(AsyncWriterObject *self, size_t pos) {
+    AsyncSlot *slot = &self->slots[pos & self->mask];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + 1;
+}
+
+static int
+AsyncWriter_full(AsyncWriterObject *self) {
+    size_t pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+    AsyncSlot *slot = &self->slots[pos & self->mask];
+    return (intptr_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos) < 0;
+}
+
+static void
+AsyncWriter_wake_waiters(AsyncWriterObject *self) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&self->waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&self->mutex);
+        pthread_cond_broadcast(&self->progress);
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+#define ASYNC_SPIN 4096
+
+// まだ出力していない捨てた行数があれば印だけを書く。次の行を待たずに済むよう、寝る前と終わる前に呼ぶ
+static void
+AsyncWriter_write_drops(AsyncWriterObject *self) {
+    char marker[64];
+    struct iovec iov;
+    size_t drops = atomic_exchange(&self->pending_drops, 0);
+    int err;
+
+    if (drops == 0 || atomic_load_explicit(&self->error, memory_order_relaxed) != 0) {
+        return;
+    }
+    iov.iov_base = marker;
+    iov.iov_len = snprintf(marker, sizeof(marker), "[dumb_print: %zu lines dropped]\n", drops);
+    err = writev_all(self->fd, &iov, 1);
+    if (err != 0) {
+        atomic_store(&self->error, err);
+    }
+}
+
+// 書き出しスレッド本体。Python の API は一切呼ばない
+static void *
+AsyncWriter_thread(void *arg) {
+    AsyncWriterObject *self = arg;
+    struct iovec iov[IOV_MAX];
+    static char newline[] = "\n";
+    char marker[64];
+    size_t pos = 0;
+
+    for (;;) {
+        size_t drops, count = 0, i;
+        int n = 0;
+
+        // 積まれている分をまとめて 1 回の writev にする
+        while (n + 2 <= IOV_MAX - 1 && AsyncWriter_ready(self, pos + count)) {
+            AsyncSlot *slot = &self->slots[(pos + count) & self->mask];
+            iov[n].iov_base = (void *) slot->data;
+            iov[n].iov_len = slot->len;
+            iov[n + 1].iov_base = newline;
+            iov[n + 1].iov_len = 1;
+            n += 2;
+            count++;
+        }
+        if (count == 0) {
+            // 寝る前に少しだけ回る。行が続けて来ているときに毎回起こされるのを避ける
+            // CPU が 1 つしかなければプロデューサの邪魔になるだけなので回らない
+            for (i = 0; i < self->spin && !AsyncWriter_ready(self, pos); i++) {
+            }
+            if (i < self->spin) {
+                continue;
+            }
+            AsyncWriter_write_drops(self);
+            pthread_mutex_lock(&self->mutex);
+            atomic_store(&self->sleeping, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!AsyncWriter_ready(self, pos)) {
+                if (atomic_load(&self->stop)) {
+                    pthread_mutex_unlock(&self->mutex);
+                    break;
+                }
+                pthread_cond_wait(&self->not_empty, &self->mutex);
+            }
+            atomic_store(&self->sleeping, 0);
+            pthread_mutex_unlock(&self->mutex);
+            continue;
+        }
+        drops = atomic_exchange(&self->pending_drops, 0);
+        if (drops > 0) {
+            int len = snprintf(marker, sizeof(marker), "[dumb_print: %zu lines dropped]\n", drops);
+            memmove(iov + 1, iov, n * sizeof(struct iovec));
+            iov[0].iov_base = marker;
+            iov[0].iov_len = len;
+            n++;
+        }
+        // エラーの後も読み捨ててキューは進める。止めるとプロデューサが詰まる
+        if (atomic_load_explicit(&self->error, memory_order_relaxed) == 0) {
+            int err = writev_all(self->fd, iov, n);
+            if (err != 0) {
+                atomic_store(&self->error, err);
+            }
+        }
+        for (i = 0; i < count; i++) {
+            AsyncSlot *slot = &self->slots[(pos + i) & self->mask];
+            atomic_store_explicit(&slot->seq, pos + i + self->capacity, memory_order_release);
+        }
+        pos += count;
+        atomic_store_explicit(&self->written_pos, pos, memory_order_release);
+        AsyncWriter_wake_waiters(self);
+    }
+    // 寝る前に書いた後から止まるまでの間に捨てた分
+    AsyncWriter_write_drops(self);
+    return NULL;
+}
+
+// GIL を持った状態で呼ぶ。積めたら 1、満杯なら 0
+static int
+AsyncWriter_enqueue(AsyncWriterObject *self, PyObject *obj, const char *data, Py_ssize_t len) {
+    AsyncSlot *slot;
+    PyObject *old;
+    size_t pos, depth, high;
+
+    pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        intptr_t diff;
+
+        slot = &self->slots[pos & self->mask];
+        diff = (intptr_t) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&self->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    old = slot->obj;
+    Py_INCREF(obj);
+    slot->obj = obj;
+    slot->data = data;
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    depth = pos + 1 - atomic_load_explicit(&self->written_pos, memory_order_relaxed);
+    high = atomic_load_explicit(&self->high_water, memory_order_relaxed);
+    while (depth > high && !atomic_compare_exchange_weak_explicit(&self->high_water, &high, depth,
+                                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&self->sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&self->mutex);
+        pthread_cond_signal(&self->not_empty);
+        pthread_mutex_unlock(&self->mutex);
+    }
+    // 前の周回で書き終わったオブジェクトはここで手放す
+    Py_XDECREF(old);
+    return 1;
+}
+
+static int
+AsyncWriter_check(AsyncWriterObject *self) {
+    if (!self->started || self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed AsyncWriter");
+        return -1;
+    }
+    return 0;
+}
+
+// 書き出しスレッドで起きたエラーがあれば例外にして -1
+static int
+AsyncWriter_raise_error(AsyncWriterObject *self) {
+    int err = atomic_exchange(&self->error, 0);
+
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+// 書き出しスレッドを止めて join し、残っている参照を手放す
+static void
+AsyncWriter_shutdown(AsyncWriterObject *self) {
+    size_t i;
+
+    self->closed = 1;
+    pthread_mutex_lock(&self->mutex);
+    atomic_store(&self->stop, 1);
+    pthread_cond_signal(&self->not_empty);
+    pthread_cond_broadcast(&self->progress);
+    pthread_mutex_unlock(&self->mutex);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS
+    for (i = 0; i < (size_t) self->capacity; i++) {
+        Py_CLEAR(self->slots[i].obj);
+    }
+}
+
+static void
+AsyncWriter_dealloc(AsyncWriterObject *self) {
+    if (self->started) {
+        if (!self->closed) {
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            AsyncWriter_shutdown(self);
+            if (AsyncWriter_raise_error(self) < 0) {
+                PyErr_WriteUnraisable((PyObject *) self);
+            }
+            PyErr_Restore(type, value, tb);
+        }
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->not_empty);
+        pthread_cond_destroy(&self->progress);
+    }
+    PyMem_Free(self->slots);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+AsyncWriter_init(AsyncWriterObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fd", "capacity", "policy", NULL};
+    int fd = 1, policy, err;
+    Py_ssize_t capacity = 65536, size;
+    const char *policy_name = "block";
+    sigset_t all, old;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ins", kwlist, &fd, &capacity, &policy_name)) {
+        return -1;
+    }
+    if (self->started) {
+        PyErr_SetString(PyExc_RuntimeError, "AsyncWriter is already initialized");
+        return -1;
+    }
+    if (fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "fd must be non-negative");
+        return -1;
+    }
+    if (capacity <= 0 || capacity > ((Py_ssize_t) 1 << 30)) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be between 1 and 2**30");
+        return -1;
+    }
+    for (policy = 0; policy < (int) Py_ARRAY_LENGTH(policy_names); policy++) {
+        if (strcmp(policy_name, policy_names[policy]) == 0) {
+            break;
+        }
+    }
+    if (policy == (int) Py_ARRAY_LENGTH(policy_names)) {
+        PyErr_Format(PyExc_ValueError, "policy must be 'block', 'drop' or 'count', not '%s'", policy_name);
+        return -1;
+    }
+    // 添字を & で取れるように 2 の冪に切り上げる
+    for (size = 1; size < capacity; size <<= 1) {
+    }
+    self->slots = PyMem_Calloc(size, sizeof(AsyncSlot));
+    if (self->slots == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < size; i++) {
+        atomic_init(&self->slots[i].seq, (size_t) i);
+    }
+    self->fd = fd;
+    self->policy = policy;
+    self->capacity = size;
+    self->mask = size - 1;
+    self->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? ASYNC_SPIN : 0;
+    atomic_init(&self->sleeping, 0);
+    atomic_init(&self->waiters, 0);
+    atomic_init(&self->stop, 0);
+    atomic_init(&self->error, 0);
+    atomic_init(&self->dropped, 0);
+    atomic_init(&self->pending_drops, 0);
+    atomic_init(&self->high_water, 0);
+    atomic_init(&self->enqueue_pos, 0);
+    atomic_init(&self->written_pos, 0);
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->not_empty, NULL);
+    pthread_cond_init(&self->progress, NULL);
+
+    // シグナルは Python のメインスレッドで受けたいので、書き出しスレッドでは全部ブロックしておく
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&self->thread, NULL, AsyncWriter_thread, self);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->not_empty);
+        pthread_cond_destroy(&self->progress);
+        PyMem_Free(self->slots);
+        self->slots = NULL;
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    self->started = 1;
+    return 0;
+}
+
+static PyObject *
+AsyncWriter_print(AsyncWriterObject *self, PyObject *arg) {
+    const char *data;
+    Py_ssize_t len;
+
+    // str は UTF-8 表現がオブジェクトにキャッシュされるので、参照を持っていればポインタは有効なまま
+    if (PyUnicode_Check(arg)) {
+        data = PyUnicode_AsUTF8AndSize(arg, &len);
+        if (data == NULL) {
+            return NULL;
+        }
+    } else if (PyBytes_Check(arg)) {
+        data = PyBytes_AS_STRING(arg);
+        len = PyBytes_GET_SIZE(arg);
+    } else {
+        PyErr_Format(PyExc_TypeError, "print() argument must be str or bytes, not %.200s", Py_TYPE(arg)->tp_name);
+        return NULL;
+    }
+    if (AsyncWriter_check(self) < 0) {
+        return NULL;
+    }
+    while (!AsyncWriter_enqueue(self, arg, data, len)) {
+        if (self->policy != POLICY_BLOCK) {
+            atomic_fetch_add_explicit(&self->dropped, 1, memory_order_relaxed);
+            if (self->policy == POLICY_COUNT) {
+                atomic_fetch_add_explicit(&self->pending_drops, 1, memory_order_relaxed);
+            }
+            Py_RETURN_FALSE;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->mutex);
+        atomic_fetch_add(&self->waiters, 1);
+        while (AsyncWriter_full(self) && !atomic_load(&self->stop)) {
+            pthread_cond_wait(&self->progress, &self->mutex);
+        }
+        atomic_fetch_sub(&self->waiters, 1);
+        pthread_mutex_unlock(&self->mutex);
+        Py_END_ALLOW_THREADS
+        // 待っている間に close() された
+        if (AsyncWriter_check(self) < 0) {
+            return NULL;
+        }
+    }
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+AsyncWriter_flush(AsyncWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    size_t target;
+
+    if (AsyncWriter_check(self) < 0) {
+        return NULL;
+    }
+    // 呼んだ時点までに積まれた行が書き出されるまで待つ
+    target = atomic_load(&self->enqueue_pos);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->mutex);
+    atomic_fetch_add(&self->waiters, 1);
+    while ((intptr_t) (atomic_load(&self->written_pos) - target) < 0 && !atomic_load(&self->stop)) {
+        pthread_cond_wait(&self->progress, &self->mutex);
+    }
+    atomic_fetch_sub(&self->waiters, 1);
+    pthread_mutex_unlock(&self->mutex);
+    Py_END_ALLOW_THREADS
+    if (AsyncWriter_raise_error(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+AsyncWriter_close(AsyncWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (!self->started || self->closed) {
+        Py_RETURN_NONE;
+    }
+    // 積まれている行はすべて書き出してからスレッドが終わる。fd は閉じない
+    AsyncWriter_shutdown(self);
+    if (AsyncWriter_raise_error(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+AsyncWriter_enter(AsyncWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (AsyncWriter_check(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+AsyncWriter_exit(AsyncWriterObject *self, PyObject *args) {
+    return AsyncWriter_close(self, NULL);
+}
+
+static PyObject *
+AsyncWriter_getdepth(AsyncWriterObject *self, void *closure) {
+    size_t enqueued = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+    size_t written = atomic_load_explicit(&self->written_pos, memory_order_relaxed);
+    return PyLong_FromSize_t(enqueued - written);
+}
+
+static PyObject *
+AsyncWriter_gethigh_water(AsyncWriterObject *self, void *closure) {
+    return PyLong_FromSize_t(atomic_load_explicit(&self->high_water, memory_order_relaxed));
+}
+
+static PyObject *
+AsyncWriter_getenqueued(AsyncWriterObject *self, void *closure) {
+    return PyLong_FromSize_t(atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed));
+}
+
+static PyObject *
+AsyncWriter_getwritten(AsyncWriterObject *self, void *closure) {
+    return PyLong_FromSize_t(atomic_load_explicit(&self->written_pos, memory_order_relaxed));
+}
+
+static PyObject *
+AsyncWriter_getdropped(AsyncWriterObject *self, void *closure) {
+    return PyLong_FromSize_t(atomic_load_explicit(&self->dropped, memory_order_relaxed));
+}
+
+static PyObject *
+AsyncWriter_getpolicy(AsyncWriterObject *self, void *closure) {
+    return PyUnicode_FromString(policy_names[self->policy]);
+}
+
+static PyMethodDef AsyncWriter_methods[] = {
+    {"print", (PyCFunction) AsyncWriter_print, METH_O,
+        "Queue a str or bytes line for the writer thread. Returns False if it was dropped"},
+    {"flush", (PyCFunction) AsyncWriter_flush, METH_NOARGS,
+        "Wait until every line queued so far has been written, and raise any write error"},
+    {"close", (PyCFunction) AsyncWriter_close, METH_NOARGS,
+        "Drain the queue and stop the writer thread. The fd is left open"},
+    {"__enter__", (PyCFunction) AsyncWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) AsyncWriter_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef AsyncWriter_members[] = {
+    {"fd", T_INT, offsetof(AsyncWriterObject, fd), READONLY, "file descriptor written to"},
+    {"capacity", T_PYSSIZET, offsetof(AsyncWriterObject, capacity), READONLY, "queue capacity in lines"},
+    {NULL},
+};
+
+static PyGetSetDef AsyncWriter_getsetters[] = {
+    {"depth", (getter) AsyncWriter_getdepth, NULL, "lines queued but not yet written", NULL},
+    {"high_water", (getter) AsyncWriter_gethigh_water, NULL, "largest depth seen", NULL},
+    {"enqueued", (getter) AsyncWriter_getenqueued, NULL, "lines accepted into the queue", NULL},
+    {"written", (getter) AsyncWriter_getwritten, NULL, "lines handed to the fd by the writer thread", NULL},
+    {"dropped", (getter) AsyncWriter_getdropped, NULL, "lines discarded because the queue was full", NULL},
+    {"policy", (getter) AsyncWriter_getpolicy, NULL, "backpressure policy", NULL},
+    {NULL},
+};
+
+static PyTypeObject AsyncWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.AsyncWriter",
+    .tp_doc = "AsyncWriter(fd=1, capacity=65536, policy='block')\n"
+              "Line writer whose output is done by a native background thread fed through a lock-free queue.\n"
+              "policy decides what print() does when the queue is full: 'block' waits, 'drop' discards the\n"
+              "line, 'count' discards it and later writes a line saying how many were dropped.",
+    .tp_basicsize = sizeof(AsyncWriterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) AsyncWriter_init,
+    .tp_dealloc = (destructor) AsyncWriter_dealloc,
+    .tp_methods = AsyncWriter_methods,
+    .tp_members = AsyncWriter_members,
+    .tp_getset = AsyncWriter_getsetters,
+};
+
+// ---- BinaryLog ----
+// 書式化はせず、書式の ID と引数の生の値だけを書き出す。文字列にするのは decode_binlog.py がオフラインで行う
+// Writer を継承してバッファとロックをそのまま使う。ストリームの形式（整数はすべてリトルエンディアン）:
+//   ヘッダ      "DPBLOG1\n"
+//   'F' 書式    u32 id, u32 len, UTF-8
+//   'L' ログ    u32 id, u64 時刻(ns, CLOCK_REALTIME), u8 引数の数, 引数...
+//   'T' テキスト u32 len, UTF-8
+// 引数はタグ 1 バイトに続けて
+//   'i' i64 / 'd' f64 / '?' u8 / 'n' なし / 's' u32 len + UTF-8 / 'b' u32 len + バイト列
+//   'I' int64 に収まらない整数。u32 len + 10 進表記
+
+#define BINLOG_MAGIC "DPBLOG1\n"
+#define BINLOG_MAX_ARGS 255
+
+typedef struct {
+    WriterObject writer;
+    PyObject *formats;  // 書式文字列 -> ID
+} BinaryLogObject;
+
+typedef struct {
+    char tag;
+    union {
+        int64_t i;
+        double d;
+    } v;
+    const char *data;
+    Py_ssize_t len;
+} BinaryLogArg;
+
+static char *
+put_u32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = (char) (v >> (8 * i));
+    }
+    return p;
+}
+
+static char *
+put_u64(char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        *p++ = (char) (v >> (8 * i));
+    }
+    return p;
+}
+
+// str(obj) を作って *temps に入れる。戻り値は借用参照
+static PyObject *
+BinaryLog_str(PyObject *obj, PyObject **temps) {
+    PyObject *text;
+
+    if (*temps == NULL) {
+        *temps = PyList_New(0);
+        if (*temps == NULL) {
+            return NULL;
+        }
+    }
+    text = PyObject_Str(obj);
+    if (text == NULL) {
+        return NULL;
+    }
+    if (PyList_Append(*temps, text) < 0) {
+        Py_DECREF(text);
+        return NULL;
+    }
+    Py_DECREF(text);
+    return text;
+}
+
+// obj を引数 1 個分に変換する。書き出しの途中で失敗しないよう、変換はすべて書く前に済ませる
+// 対応していない型は str() した結果を記録する。そのとき作った文字列は *temps に入れて生かしておく
+static int
+BinaryLog_convert(PyObject *obj, BinaryLogArg *arg, PyObject **temps) {
+    if (obj == Py_None) {
+        arg->tag = 'n';
+    } else if (PyBool_Check(obj)) {
+        arg->tag = '?';
+        arg->v.i = obj == Py_True;
+    } else if (PyLong_Check(obj)) {
+        int overflow;
+        arg->v.i = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (overflow == 0) {
+            if (arg->v.i == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+            arg->tag = 'i';
+        } else {
+            PyObject *text = BinaryLog_str(obj, temps);
+            if (text == NULL) {
+                return -1;
+            }
+            arg->tag = 'I';
+            arg->data = PyUnicode_AsUTF8AndSize(text, &arg->len);
+            if (arg->data == NULL) {
+                return -1;
+            }
+        }
+    } else if (PyFloat_Check(obj)) {
+        arg->tag = 'd';
+        arg->v.d = PyFloat_AS_DOUBLE(obj);
+    } else if (PyBytes_Check(obj)) {
+        arg->tag = 'b';
+        arg->data = PyBytes_AS_STRING(obj);
+        arg->len = PyBytes_GET_SIZE(obj);
+    } else {
+        if (!PyUnicode_Check(obj)) {
+            obj = BinaryLog_str(obj, temps);
+            if (obj == NULL) {
+                return -1;
+            }
+        }
+        arg->tag = 's';
+        arg->data = PyUnicode_AsUTF8AndSize(obj, &arg->len);
+        if (arg->data == NULL) {
+            return -1;
+        }
+    }
+    if ((arg->tag == 's' || arg->tag == 'b' || arg->tag == 'I') && arg->len > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "BinaryLog argument is too long");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+BinaryLog_dealloc(BinaryLogObject *self) {
+    Py_CLEAR(self->formats);
+    WriterType.tp_dealloc((PyObject *) self);
+}
+
+static int
+BinaryLog_init(BinaryLogObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *formats;
+    int r;
+
+    if (WriterType.tp_init((PyObject *) self, args, kwds) < 0) {
+        return -1;
+    }
+    formats = PyDict_New();
+    if (formats == NULL) {
+        return -1;
+    }
+    Py_XSETREF(self->formats, formats);
+    // ID は先頭から振り直すので、デコーダが区切りとわかるようにヘッダも書き直す
+    Writer_lock(&self->writer);
+    r = Writer_append_locked(&self->writer, BINLOG_MAGIC, sizeof(BINLOG_MAGIC) - 1);
+    PyThread_release_lock(self->writer.lock);
+    return r;
+}
+
+static PyObject *
+BinaryLog_register(BinaryLogObject *self, PyObject *fmt) {
+    PyObject *id, *key;
+    const char *text;
+    Py_ssize_t len;
+    char head[9];
+    int r;
+
+    if (!PyUnicode_Check(fmt)) {
+        PyErr_Format(PyExc_TypeError, "register() argument must be str, not %.200s", Py_TYPE(fmt)->tp_name);
+        return NULL;
+    }
+    if (Writer_check(&self->writer) < 0) {
+        return NULL;
+    }
+    // 登録済みならロックを取らずに返す。dict には 'F' を書き終えたものしか入らない
+    id = PyDict_GetItemWithError(self->formats, fmt);
+    if (id != NULL) {
+        Py_INCREF(id);
+        return id;
+    }
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    // ロックを持ったまま dict を触るので、__hash__ や __eq__ で Python のコードが走らないよう str にしておく
+    key = PyUnicode_FromObject(fmt);
+    if (key == NULL) {
+        return NULL;
+    }
+    text = PyUnicode_AsUTF8AndSize(key, &len);
+    if (text == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    if (len > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "format is too long");
+        Py_DECREF(key);
+        return NULL;
+    }
+    // 'F' の書き出しと dict への登録をロックの中でまとめて行う
+    // 先に dict に入れると、書き出しに失敗したときや、書き出す前に別スレッドが log() したときに
+    // ストリームに定義のない ID が現れる
+    Writer_lock(&self->writer);
+    // ロックを待つ間に別スレッドが同じ書式を登録していることがある
+    id = PyDict_GetItemWithError(self->formats, key);
+    if (id != NULL || PyErr_Occurred()) {
+        Py_XINCREF(id);
+        PyThread_release_lock(self->writer.lock);
+        Py_DECREF(key);
+        return id;
+    }
+    id = PyLong_FromSsize_t(PyDict_GET_SIZE(self->formats));
+    r = id == NULL ? -1 : 0;
+    if (r == 0) {
+        head[0] = 'F';
+        put_u32(put_u32(head + 1, (uint32_t) PyDict_GET_SIZE(self->formats)), (uint32_t) len);
+        r = Writer_append_locked(&self->writer, head, sizeof(head));
+    }
+    if (r == 0) {
+        r = Writer_append_locked(&self->writer, text, len);
+    }
+    // 書けた後に dict への登録だけ失敗した場合は、次の register() で同じ ID のまま書き直される
+    if (r == 0) {
+        r = PyDict_SetItem(self->formats, key, id);
+    }
+    PyThread_release_lock(self->writer.lock);
+    Py_DECREF(key);
+    if (r < 0) {
+        Py_XDECREF(id);
+        return NULL;
+    }
+    return id;
+}
+
+// log(id, *args)。ホットパスなので METH_FASTCALL で受ける
+static PyObject *
+BinaryLog_log(BinaryLogObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    BinaryLogArg stack_args[16], *conv = stack_args;
+    PyObject *temps = NULL;
+    struct timespec ts;
+    Py_ssize_t id, count, i;
+    char head[14], *p;
+    int r;
+
+    if (nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "log() missing required argument 'id'");
+        return NULL;
+    }
+    if (Writer_check(&self->writer) < 0) {
+        return NULL;
+    }
+    id = PyLong_AsSsize_t(args[0]);
+    if (id == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (id < 0 || id >= PyDict_GET_SIZE(self->formats)) {
+        PyErr_Format(PyExc_ValueError, "unknown format id %zd", id);
+        return NULL;
+    }
+    count = nargs - 1;
+    if (count > BINLOG_MAX_ARGS) {
+        PyErr_Format(PyExc_TypeError, "log() takes at most %d format arguments", BINLOG_MAX_ARGS);
+        return NULL;
+    }
+    if (count > (Py_ssize_t) Py_ARRAY_LENGTH(stack_args)) {
+        conv = PyMem_New(BinaryLogArg, count);
+        if (conv == NULL) {
+            return PyErr_NoMemory();
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (BinaryLog_convert(args[i + 1], &conv[i], &temps) < 0) {
+            goto error;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    head[0] = 'L';
+    p = put_u32(head + 1, (uint32_t) id);
+    p = put_u64(p, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+    *p = (char) count;
+    Writer_lock(&self->writer);
+    r = Writer_append_locked(&self->writer, head, sizeof(head));
+    for (i = 0; i < count && r == 0; i++) {
+        char buf[9];
+        buf[0] = conv[i].tag;
+        switch (conv[i].tag) {
+            case 'n':
+                r = Writer_append_locked(&self->writer, buf, 1);
+                break;
+            case '?':
+                buf[1] = (char) conv[i].v.i;
+                r = Writer_append_locked(&self->writer, buf, 2);
+                break;
+            case 'i':
+                put_u64(buf + 1, (uint64_t) conv[i].v.i);
+                r = Writer_append_locked(&self->writer, buf, 9);
+                break;
+            case 'd': {
+                uint64_t bits;
+                memcpy(&bits, &conv[i].v.d, sizeof(bits));
+                put_u64(buf + 1, bits);
+                r = Writer_append_locked(&self->writer, buf, 9);
+                break;
+            }
+            default:
+                put_u32(buf + 1, (uint32_t) conv[i].len);
+                r = Writer_append_locked(&self->writer, buf, 5);
+                if (r == 0) {
+                    r = Writer_append_locked(&self->writer, conv[i].data, conv[i].len);
+                }
+                break;
+        }
+    }
+    PyThread_release_lock(self->writer.lock);
+    Py_XDECREF(temps);
+    if (conv != stack_args) {
+        PyMem_Free(conv);
+    }
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+
+  error:
+    Py_XDECREF(temps);
+    if (conv != stack_args) {
+        PyMem_Free(conv);
+    }
+    return NULL;
+}
+
+static PyObject *
+BinaryLog_print(BinaryLogObject *self, PyObject *args) {
+    const char *text;
+    Py_ssize_t len;
+    char head[5];
+    int r;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
+        return NULL;
+    }
+    if (Writer_check(&self->writer) < 0) {
+        return NULL;
+    }
+    if (len > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "text is too long");
+        return NULL;
+    }
+    head[0] = 'T';
+    put_u32(head + 1, (uint32_t) len);
+    Writer_lock(&self->writer);
+    r = Writer_append_locked(&self->writer, head, sizeof(head));
+    if (r == 0) {
+        r = Writer_append_locked(&self->writer, text, len);
+    }
+    PyThread_release_lock(self->writer.lock);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef BinaryLog_methods[] = {
+    {"register", (PyCFunction) BinaryLog_register, METH_O,
+        "Record a str.format() template and return its id. Registering the same template again returns the same id"},
+    {"log", (PyCFunction) (void (*)(void)) BinaryLog_log, METH_FASTCALL,
+        "log(id, *args)\nAppend a record holding the template id, a timestamp and the raw argument values"},
+    {"print", (PyCFunction) BinaryLog_print, METH_VARARGS, "Append a preformatted text line"},
+    {NULL},
+};
+
+static PyTypeObject BinaryLogType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.BinaryLog",
+    .tp_doc = "BinaryLog(fd=1, bufsize=1048576)\n"
+              "Writer that logs template ids and raw arguments in a compact binary stream.\n"
+              "Render the stream with decode_binlog.py.",
+    .tp_basicsize = sizeof(BinaryLogObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_init = (initproc) BinaryLog_init,
+    .tp_dealloc = (destructor) BinaryLog_dealloc,
+    .tp_methods = BinaryLog_methods,
+};
+
+// ---- RingLog ----
+// mmap したファイルをリングバッファとして使う。書き込みはメモリへのストアだけなので
+// プロセスが落ちてもページキャッシュに残った末尾を read_ringlog.py で読める
+// ファイルは 64 バイトのヘッダとデータ領域からなる（値はすべてホストのバイトオーダー）
+// head と tail はデータ領域の先頭からの通算のオフセットで、実際の位置は capacity で割った余り
+// レコードはデータ領域の終わりをまたがない。収まらなければ残りを埋め草にして先頭に戻る
+// 本文を書き終えてから head を進めるので、書き込み中に落ちたレコードは読まれない
+
+#define RING_MAGIC "DPRING1"
+#define RING_RECORD 0
+#define RING_PAD 1
+#define RING_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+typedef struct {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;  // 次に書く位置
+    uint64_t tail;  // 最も古いレコードの位置
+    uint64_t seq;   // 次のレコードの通し番号
+    char reserved[24];
+} RingHeader;
+
+typedef struct {
+    uint32_t len;   // 本文のバイト数。埋め草なら後ろの空きの大きさ
+    uint32_t kind;
+    uint64_t seq;
+    uint64_t time;  // CLOCK_REALTIME のナノ秒
+} RingRecord;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    RingHeader *header;  // NULL なら閉じている
+    char *data;
+    size_t map_size;
+    Py_ssize_t capacity;
+} RingLogObject;
+
+// 位置 pos から始まるレコードの大きさ。データ領域の終わりまで飛ぶ場合はその距離を返す
+static uint64_t
+RingLog_span(RingLogObject *self, uint64_t pos) {
+    uint64_t cap = self->header->capacity, p = pos % cap;
+    RingRecord *rec;
+
+    if (cap - p < sizeof(RingRecord)) {
+        return cap - p;
+    }
+    rec = (RingRecord *) (self->data + p);
+    if (rec->kind == RING_PAD) {
+        return cap - p;
+    }
+    return sizeof(RingRecord) + RING_ALIGN(rec->len);
+}
+
+static int
+RingLog_check(RingLogObject *self) {
+    if (self->header == NULL) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed RingLog");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+RingLog_unmap(RingLogObject *self) {
+    if (self->header != NULL) {
+        munmap(self->header, self->map_size);
+        self->header = NULL;
+        self->data = NULL;
+    }
+}
+
+static void
+RingLog_dealloc(RingLogObject *self) {
+    RingLog_unmap(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+RingLog_init(RingLogObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "size", NULL};
+    PyObject *filename, *path;
+    Py_ssize_t size = 1 << 20;
+    RingHeader *header;
+    struct stat st;
+    uint64_t cap;
+    size_t map_size;
+    int fd, fresh;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &filename, &size)) {
+        return -1;
+    }
+    if (!PyUnicode_FSConverter(filename, &path)) {
+        return -1;
+    }
+    if (size < 4096) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_ValueError, "size must be at least 4096");
+        return -1;
+    }
+    fd = open(PyBytes_AS_STRING(path), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        Py_DECREF(path);
+        return -1;
+    }
+
+    // 既存のログならその容量のまま続きに書く。作り直すと落ちる前の記録が消えてしまう
+    // 空でもリングでもないファイルは壊さないように断る
+    cap = RING_ALIGN((uint64_t) size);
+    fresh = st.st_size == 0;
+    if (!fresh) {
+        RingHeader old;
+        if ((size_t) st.st_size < sizeof(RingHeader) || pread(fd, &old, sizeof(old), 0) != sizeof(old)
+            || memcmp(old.magic, RING_MAGIC, 8) != 0 || old.capacity < sizeof(RingRecord) || old.capacity % 8 != 0
+            || (uint64_t) st.st_size != sizeof(RingHeader) + old.capacity
+            || old.tail > old.head || old.head - old.tail > old.capacity) {
+            PyErr_Format(PyExc_ValueError, "%R is not a RingLog file", filename);
+            close(fd);
+            Py_DECREF(path);
+            return -1;
+        }
+        cap = old.capacity;
+    }
+    map_size = sizeof(RingHeader) + cap;
+    if (fresh && ftruncate(fd, map_size) < 0) {
+        goto os_error;
+    }
+    header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        goto os_error;
+    }
+    close(fd);
+    Py_DECREF(path);
+    if (fresh) {
+        memcpy(header->magic, RING_MAGIC, 8);
+        header->capacity = cap;
+        header->head = 0;
+        header->tail = 0;
+        header->seq = 0;
+    }
+    RingLog_unmap(self);
+    self->header = header;
+    self->data = (char *) (header + 1);
+    self->map_size = map_size;
+    self->capacity = (Py_ssize_t) cap;
+    return 0;
+
+  os_error:
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    close(fd);
+    Py_DECREF(path);
+    return -1;
+}
+
+static PyObject *
+RingLog_print(RingLogObject *self, PyObject *args) {
+    const char *text;
+    Py_ssize_t len;
+    RingHeader *h;
+    RingRecord *rec;
+    struct timespec ts;
+    uint64_t cap, total, skip, head, need, p;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
+        return NULL;
+    }
+    if (RingLog_check(self) < 0) {
+        return NULL;
+    }
+    h = self->header;
+    cap = h->capacity;
+    total = sizeof(RingRecord) + RING_ALIGN((uint64_t) len);
+    if (total > cap || (uint64_t) len > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "record is larger than the ring");
+        return NULL;
+    }
+    // GIL を持ったまま書くので、このオブジェクトへの書き込みは直列化されている
+    head = h->head;
+    p = head % cap;
+    skip = cap - p < total ? cap - p : 0;
+    // これから上書きする範囲にある古いレコードを捨てる。上書きの前に tail を進めておく
+    need = head + skip + total;
+    if (need > cap) {
+        uint64_t tail = h->tail;
+        while (tail < need - cap) {
+            tail += RingLog_span(self, tail);
+        }
+        __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (skip > 0) {
+        if (skip >= sizeof(RingRecord)) {
+            rec = (RingRecord *) (self->data + p);
+            rec->len = (uint32_t) (skip - sizeof(RingRecord));
+            rec->kind = RING_PAD;
+            rec->seq = 0;
+            rec->time = 0;
+        }
+        head += skip;
+        p = 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec = (RingRecord *) (self->data + p);
+    rec->len = (uint32_t) len;
+    rec->kind = RING_RECORD;
+    rec->seq = h->seq++;
+    rec->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy(rec + 1, text, len);
+    __atomic_store_n(&h->head, head + total, __ATOMIC_RELEASE);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+RingLog_sync(RingLogObject *self, PyObject *Py_UNUSED(ignored)) {
+    int r;
+
+    if (RingLog_check(self) < 0) {
+        return NULL;
+    }
+    // プロセスが落ちるだけなら不要。OS ごと落ちるのに備えるときだけ呼ぶ
+    Py_BEGIN_ALLOW_THREADS
+    r = msync(self->header, self->map_size, MS_SYNC);
+    Py_END_ALLOW_THREADS
+    if (r < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+RingLog_close(RingLogObject *self, PyObject *Py_UNUSED(ignored)) {
+    RingLog_unmap(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+RingLog_enter(RingLogObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (RingLog_check(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+RingLog_exit(RingLogObject *self, PyObject *args) {
+    return RingLog_close(self, NULL);
+}
+
+static PyObject *
+RingLog_getused(RingLogObject *self, void *closure) {
+    if (RingLog_check(self) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(self->header->head - self->header->tail);
+}
+
+static PyObject *
+RingLog_getrecords(RingLogObject *self, void *closure) {
+    if (RingLog_check(self) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(self->header->seq);
+}
+
+static PyMethodDef RingLog_methods[] = {
+    {"print", (PyCFunction) RingLog_print, METH_VARARGS, "Store text as the newest record, overwriting the oldest ones"},
+    {"sync", (PyCFunction) RingLog_sync, METH_NOARGS, "msync(2) the ring so it also survives an OS crash"},
+    {"close", (PyCFunction) RingLog_close, METH_NOARGS, "Unmap the file. Its contents stay readable"},
+    {"__enter__", (PyCFunction) RingLog_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) RingLog_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef RingLog_members[] = {
+    {"capacity", T_PYSSIZET, offsetof(RingLogObject, capacity), READONLY, "size of the data area in bytes"},
+    {NULL},
+};
+
+static PyGetSetDef RingLog_getsetters[] = {
+    {"used", (getter) RingLog_getused, NULL, "bytes of the data area holding live records", NULL},
+    {"records", (getter) RingLog_getrecords, NULL, "records written since the file was created", NULL},
+    {NULL},
+};
+
+static PyTypeObject RingLogType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.RingLog",
+    .tp_doc = "RingLog(path, size=1048576)\n"
+              "Crash-safe log sink: records go into a memory-mapped file used as a circular buffer.\n"
+              "An existing ring at path is appended to with its own size. Read it with read_ringlog.py.",
+    .tp_basicsize = sizeof(RingLogObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) RingLog_init,
+    .tp_dealloc = (destructor) RingLog_dealloc,
+    .tp_methods = RingLog_methods,
+    .tp_members = RingLog_members,
+    .tp_getset = RingLog_getsetters,
+};
+
+// ---- Template ----
+// 書式文字列を一度だけ解析して「リテラルを写す」「i 番目の引数を書く」という命令列にしておく
+// よく使う書き方は中間の str を作らずに直接バッファへ書く
+//   {}    : int は 2 桁ずつの表で変換、float は repr と同じ最短の表記、str はそのまま
+//   {:d}  : int
+//   {:.Nf}: int か float を小数点以下 N 桁
+// それ以外の書式指定や !r などの変換は format() に任せるので、結果は str.format() と同じになる
+
+enum {
+    OP_LITERAL,
+    OP_PLAIN,  // {}
+    OP_INT,    // {:d}
+    OP_FIXED,  // {:.Nf}
+    OP_OTHER,  // format(arg, spec)
+};
+
+typedef struct {
+    int kind;
+    Py_ssize_t start;  // OP_LITERAL: literals の中の位置
+    Py_ssize_t len;
+    Py_ssize_t index;  // 引数の番号
+    int precision;
+    char conversion;   // 'r', 's', 'a' または 0
+    PyObject *spec;    // 書式指定。OP_PLAIN では NULL
+} TemplateOp;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    PyObject *format;
+    char *literals;
+    TemplateOp *ops;
+    Py_ssize_t nops;
+} TemplateObject;
+
+// 出力先。小さいものはスタック上の領域で済ませる
+typedef struct {
+    char *p;
+    Py_ssize_t len;
+    Py_ssize_t cap;
+    char local[512];
+} OutBuf;
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static void
+OutBuf_init(OutBuf *out) {
+    out->p = out->local;
+    out->len = 0;
+    out->cap = sizeof(out->local);
+}
+
+static void
+OutBuf_free(OutBuf *out) {
+    if (out->p != out->local) {
+        PyMem_Free(out->p);
+    }
+}
+
+// n バイト書ける場所を返す。失敗時は例外をセットして NULL
+static char *
+OutBuf_reserve(OutBuf *out, Py_ssize_t n) {
+    if (out->len + n > out->cap) {
+        Py_ssize_t cap = out->cap;
+        char *p;
+        while (cap < out->len + n) {
+            cap *= 2;
+        }
+        if (out->p == out->local) {
+            p = PyMem_Malloc(cap);
+            if (p != NULL) {
+                memcpy(p, out->local, out->len);
+            }
+        } else {
+            p = PyMem_Realloc(out->p, cap);
+        }
+        if (p == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        out->p = p;
+        out->cap = cap;
+    }
+    return out->p + out->len;
+}
+
+static int
+OutBuf_append(OutBuf *out, const char *data, Py_ssize_t len) {
+    char *p = OutBuf_reserve(out, len);
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, data, len);
+    out->len += len;
+    return 0;
+}
+
+// v を 10 進で buf の末尾から前に向かって書き、先頭を返す
+static char *
+format_u64(char *end, uint64_t v) {
+    char *p = end;
+    while (v >= 100) {
+        unsigned i = (unsigned) (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+    return p;
+}
+
+static int
+OutBuf_append_i64(OutBuf *out, int64_t v) {
+    char tmp[24], *end = tmp + sizeof(tmp), *p;
+    uint64_t u = v < 0 ? 0 - (uint64_t) v : (uint64_t) v;
+
+    p = format_u64(end, u);
+    if (v < 0) {
+        *--p = '-';
+    }
+    return OutBuf_append(out, p, end - p);
+}
+
+static int
+OutBuf_append_str(OutBuf *out, PyObject *text) {
+    Py_ssize_t len;
+    const char *data = PyUnicode_AsUTF8AndSize(text, &len);
+    if (data == NULL) {
+        return -1;
+    }
+    return OutBuf_append(out, data, len);
+}
+
+// PyOS_double_to_string() の結果を写す
+static int
+OutBuf_append_double(OutBuf *out, double v, char code, int precision, int flags) {
+    char *text = PyOS_double_to_string(v, code, precision, flags, NULL);
+    int r;
+
+    if (text == NULL) {
+        return -1;
+    }
+    r = OutBuf_append(out, text, strlen(text));
+    PyMem_Free(text);
+    return r;
+}
+
+static const double pow10_table[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+// "%.*f" と同じ結果を書く
+// v * 10^N が 2^40 未満で、四捨五入の境目から十分離れていれば整数演算で済ませる
+// 乗算の誤差で丸めの向きが変わりうるときや巨大な値は PyOS_double_to_string() に任せる
+static int
+OutBuf_append_fixed(OutBuf *out, double v, int precision) {
+    double scaled, whole, frac;
+    uint64_t n, ip, fp;
+    char tmp[48], *end = tmp + sizeof(tmp), *p;
+    int i;
+
+    if (precision < (int) Py_ARRAY_LENGTH(pow10_table) && isfinite(v)) {
+        scaled = fabs(v) * pow10_table[precision];
+        if (scaled < 1099511627776.0) {
+            frac = modf(scaled, &whole);
+            if (fabs(frac - 0.5) > 1.0 / 1024) {
+                n = (uint64_t) whole + (frac > 0.5);
+                ip = n / (uint64_t) pow10_table[precision];
+                fp = n % (uint64_t) pow10_table[precision];
+                p = end;
+                if (precision > 0) {
+                    for (i = 0; i < precision; i++) {
+                        *--p = (char) ('0' + fp % 10);
+                        fp /= 10;
+                    }
+                    *--p = '.';
+                }
+                p = format_u64(p, ip);
+                // str.format() と同じく -0.0 や丸めて 0 になる負数にも符号を付ける
+                if (signbit(v)) {
+                    *--p = '-';
+                }
+                return OutBuf_append(out, p, end - p);
+            }
+        }
+    }
+    return OutBuf_append_double(out, v, 'f', precision, 0);
+}
+
+static void
+Template_clear_ops(TemplateObject *self) {
+    Py_ssize_t i;
+
+    for (i = 0; i < self->nops; i++) {
+        Py_CLEAR(self->ops[i].spec);
+    }
+    PyMem_Free(self->ops);
+    PyMem_Free(self->literals);
+    self->ops = NULL;
+    self->literals = NULL;
+    self->nops = 0;
+}
+
+static void
+Template_dealloc(TemplateObject *self) {
+    Template_clear_ops(self);
+    Py_XDECREF(self->format);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// 置換フィールドの中身 field[0..len) を解析して op を埋める
+static int
+Template_parse_field(TemplateOp *op, const char *field, Py_ssize_t len, Py_ssize_t *auto_index, int *numbering) {
+    const char *spec = memchr(field, ':', len);
+    const char *conv = memchr(field, '!', spec == NULL ? len : spec - field);
+    const char *name_end = conv != NULL ? conv : spec != NULL ? spec : field + len;
+    Py_ssize_t spec_len;
+
+    if (memchr(field, '{', len) != NULL) {
+        PyErr_SetString(PyExc_ValueError, "nested replacement fields are not supported by Template");
+        return -1;
+    }
+    // フィールド名。番号を省略するか数字だけを受け付ける
+    if (name_end == field) {
+        if (*numbering == 2) {
+            PyErr_SetString(PyExc_ValueError, "cannot switch from manual field specification to automatic field numbering");
+            return -1;
+        }
+        *numbering = 1;
+        op->index = (*auto_index)++;
+    } else {
+        const char *q;
+        if (*numbering == 1) {
+            PyErr_SetString(PyExc_ValueError, "cannot switch from automatic field numbering to manual field specification");
+            return -1;
+        }
+        *numbering = 2;
+        op->index = 0;
+        for (q = field; q < name_end; q++) {
+            if (*q < '0' || *q > '9' || op->index > 100000) {
+                PyObject *name = PyUnicode_FromStringAndSize(field, name_end - field);
+                if (name != NULL) {
+                    PyErr_Format(PyExc_ValueError, "Template only supports positional fields, not '%U'", name);
+                    Py_DECREF(name);
+                }
+                return -1;
+            }
+            op->index = op->index * 10 + (*q - '0');
+        }
+    }
+    op->conversion = 0;
+    if (conv != NULL) {
+        const char *conv_end = spec != NULL ? spec : field + len;
+        if (conv_end - conv != 2 || (conv[1] != 'r' && conv[1] != 's' && conv[1] != 'a')) {
+            PyErr_SetString(PyExc_ValueError, "expected 'r', 's' or 'a' after '!'");
+            return -1;
+        }
+        op->conversion = conv[1];
+    }
+    spec_len = spec == NULL ? 0 : field + len - spec - 1;
+    op->spec = NULL;
+    if (op->conversion != 0) {
+        op->kind = OP_OTHER;
+    } else if (spec_len == 0) {
+        op->kind = OP_PLAIN;
+        return 0;
+    } else if (spec_len == 1 && spec[1] == 'd') {
+        op->kind = OP_INT;
+    } else if (spec_len >= 3 && spec_len <= 4 && spec[1] == '.' && spec[spec_len] == 'f'
+               && spec[2] >= '0' && spec[2] <= '9' && (spec_len == 3 || (spec[3] >= '0' && spec[3] <= '9'))) {
+        op->kind = OP_FIXED;
+        op->precision = spec[2] - '0';
+        if (spec_len == 4) {
+            op->precision = op->precision * 10 + (spec[3] - '0');
+        }
+    } else {
+        op->kind = OP_OTHER;
+    }
+    // 速い経路で扱えない型が来たときのためにいつも書式指定を持っておく
+    op->spec = PyUnicode_FromStringAndSize(spec == NULL ? "" : spec + 1, spec_len);
+    if (op->spec == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+Template_compile(TemplateObject *self, const char *fmt, Py_ssize_t len) {
+    Py_ssize_t i = 0, lit_len = 0, auto_index = 0, max_ops;
+    int numbering = 0;
+
+    // 命令はリテラルとフィールドが交互に並ぶので、'{' の数の 2 倍 + 1 あれば足りる
+    max_ops = 1;
+    for (i = 0; i < len; i++) {
+        max_ops += fmt[i] == '{' ? 2 : 0;
+    }
+    self->ops = PyMem_New(TemplateOp, max_ops);
+    self->literals = PyMem_Malloc(len + 1);
+    if (self->ops == NULL || self->literals == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    i = 0;
+    while (i < len) {
+        Py_ssize_t start = lit_len;
+        TemplateOp *op;
+
+        // 次のフィールドまでのリテラルを {{ と }} を戻しながら集める
+        while (i < len) {
+            if (fmt[i] == '{' && i + 1 < len && fmt[i + 1] == '{') {
+                self->literals[lit_len++] = '{';
+                i += 2;
+            } else if (fmt[i] == '}' && i + 1 < len && fmt[i + 1] == '}') {
+                self->literals[lit_len++] = '}';
+                i += 2;
+            } else if (fmt[i] == '}') {
+                PyErr_SetString(PyExc_ValueError, "Single '}' encountered in format string");
+                return -1;
+            } else if (fmt[i] == '{') {
+                break;
+            } else {
+                self->literals[lit_len++] = fmt[i++];
+            }
+        }
+        if (lit_len > start) {
+            op = &self->ops[self->nops++];
+            op->kind = OP_LITERAL;
+            op->start = start;
+            op->len = lit_len - start;
+            op->spec = NULL;
+        }
+        if (i < len) {
+            const char *close = memchr(fmt + i + 1, '}', len - i - 1);
+            if (close == NULL) {
+                PyErr_SetString(PyExc_ValueError, "Single '{' encountered in format string");
+                return -1;
+            }
+            op = &self->ops[self->nops];
+            if (Template_parse_field(op, fmt + i + 1, close - fmt - i - 1, &auto_index, &numbering) < 0) {
+                return -1;
+            }
+            self->nops++;
+            i = close - fmt + 1;
+        }
+    }
+    return 0;
+}
+
+static int
+Template_init(TemplateObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"format", NULL};
+    PyObject *format;
+    const char *fmt;
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U", kwlist, &format)) {
+        return -1;
+    }
+    fmt = PyUnicode_AsUTF8AndSize(format, &len);
+    if (fmt == NULL) {
+        return -1;
+    }
+    Template_clear_ops(self);
+    if (Template_compile(self, fmt, len) < 0) {
+        Template_clear_ops(self);
+        return -1;
+    }
+    Py_INCREF(format);
+    Py_XSETREF(self->format, format);
+    return 0;
+}
+
+// op に従って arg を out に書く
+static int
+Template_render_field(TemplateOp *op, PyObject *arg, OutBuf *out) {
+    PyObject *text;
+    int r;
+
+    switch (op->kind) {
+        case OP_PLAIN:
+            if (PyUnicode_CheckExact(arg)) {
+                return OutBuf_append_str(out, arg);
+            }
+            if (PyFloat_CheckExact(arg)) {
+                return OutBuf_append_double(out, PyFloat_AS_DOUBLE(arg), 'r', 0, Py_DTSF_ADD_DOT_0);
+            }
+            // fall through
+        case OP_INT:
+            if (PyLong_CheckExact(arg)) {
+                int overflow;
+                long long v = PyLong_AsLongLongAndOverflow(arg, &overflow);
+                if (overflow == 0) {
+                    return OutBuf_append_i64(out, v);
+                }
+            }
+            break;
+        case OP_FIXED:
+            if (PyFloat_CheckExact(arg)) {
+                return OutBuf_append_fixed(out, PyFloat_AS_DOUBLE(arg), op->precision);
+            }
+            // 2^53 未満の int は double にしても値が変わらない
+            if (PyLong_CheckExact(arg)) {
+                int overflow;
+                long long v = PyLong_AsLongLongAndOverflow(arg, &overflow);
+                if (overflow == 0 && v > -(1LL << 53) && v < (1LL << 53)) {
+                    return OutBuf_append_fixed(out, (double) v, op->precision);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (op->conversion == 'r') {
+        arg = PyObject_Repr(arg);
+    } else if (op->conversion == 's') {
+        arg = PyObject_Str(arg);
+    } else if (op->conversion == 'a') {
+        arg = PyObject_ASCII(arg);
+    } else {
+        Py_INCREF(arg);
+    }
+    if (arg == NULL) {
+        return -1;
+    }
+    // str.format() と同じく書式指定がなくても format(arg, '') を呼ぶ。__format__ を持つ型は str() と結果が違う
+    // PyObject_Format() は spec が NULL なら空文字列として扱う
+    text = PyObject_Format(arg, op->spec);
+    Py_DECREF(arg);
+    if (text == NULL) {
+        return -1;
+    }
+    r = OutBuf_append_str(out, text);
+    Py_DECREF(text);
+    return r;
+}
+
+static int
+Template_render(TemplateObject *self, PyObject *const *args, Py_ssize_t nargs, OutBuf *out) {
+    Py_ssize_t i;
+
+    if (self->ops == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Template is not initialized");
+        return -1;
+    }
+    for (i = 0; i < self->nops; i++) {
+        TemplateOp *op = &self->ops[i];
+        int r;
+        if (op->kind == OP_LITERAL) {
+            r = OutBuf_append(out, self->literals + op->start, op->len);
+        } else if (op->index >= nargs) {
+            PyErr_Format(PyExc_IndexError, "Replacement index %zd out of range for positional args tuple", op->index);
+            return -1;
+        } else {
+            r = Template_render_field(op, args[op->index], out);
+        }
+        if (r < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+Template_format(TemplateObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    OutBuf out;
+    PyObject *result = NULL;
+
+    OutBuf_init(&out);
+    if (Template_render(self, args, nargs, &out) == 0) {
+        result = PyUnicode_DecodeUTF8(out.p, out.len, "surrogatepass");
+    }
+    OutBuf_free(&out);
+    return result;
+}
+
+static PyObject *
+Template_emit(TemplateObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    OutBuf out;
+    int err = 0;
+
+    OutBuf_init(&out);
+    if (Template_render(self, args, nargs, &out) < 0 || OutBuf_append(&out, "\n", 1) < 0) {
+        OutBuf_free(&out);
+        return NULL;
+    }
+    // print() の printf と順番が入れ替わらないように stdio のバッファを先に出す
+    fflush(stdout);
+    if (out.len >= RELEASE_GIL_THRESHOLD) {
+        Py_BEGIN_ALLOW_THREADS
+        err = write_all(STDOUT_FILENO, out.p, out.len);
+        Py_END_ALLOW_THREADS
+    } else {
+        err = write_all(STDOUT_FILENO, out.p, out.len);
+    }
+    OutBuf_free(&out);
+    if (err != 0) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Template_methods[] = {
+    {"emit", (PyCFunction) (void (*)(void)) Template_emit, METH_FASTCALL,
+        "emit(*args)\nFormat args and write the result and a newline to stdout"},
+    {"format", (PyCFunction) (void (*)(void)) Template_format, METH_FASTCALL,
+        "format(*args)\nReturn the formatted str, same as format.format(*args)"},
+    {NULL},
+};
+
+static PyMemberDef Template_members[] = {
+    {"pattern", T_OBJECT, offsetof(TemplateObject, format), READONLY, "the format string"},
+    {NULL},
+};
+
+static PyTypeObject TemplateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.Template",
+    .tp_doc = "Template(format)\n"
+              "str.format() template compiled once. Positional fields only.\n"
+              "{}, {:d} and {:.Nf} on int/float/str are rendered without intermediate objects.",
+    .tp_basicsize = sizeof(TemplateObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Template_init,
+    .tp_dealloc = (destructor) Template_dealloc,
+    .tp_methods = Template_methods,
+    .tp_members = Template_members,
+};
+
+// ---- CompressedWriter ----
+// 行をブロックに溜め、いっぱいになったら圧縮スレッドに渡す。圧縮と write(2) は呼び出し側のスレッドでは行わない
+// ブロックは 2 枚を交互に使う。圧縮が 1 ブロック以上遅れたときだけ呼び出し側が待つ
+// ブロックごとに Z_SYNC_FLUSH（zstd なら ZSTD_e_flush）するので、書き出された分はいつでも伸長できる
+
+#define COMPRESS_OUT_SIZE (256 * 1024)
+
+enum {
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+};
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int fd;
+    int format;
+    int level;
+    Py_ssize_t block_size;
+    char *blocks[2];
+    int cur;              // 呼び出し側が埋めているブロック
+    Py_ssize_t fill;      // blocks[cur] に溜まっているバイト数
+    PyThread_type_lock lock;  // blocks[cur] と fill を守る。待つ間は GIL を手放すため
+    int started;
+    int closed;
+    pthread_t thread;
+    // ここから下は mutex で守る
+    pthread_mutex_t mutex;
+    pthread_cond_t work;  // 圧縮スレッドが待つ
+    pthread_cond_t done;  // 呼び出し側が待つ
+    Py_ssize_t pending;   // 圧縮待ちのブロックの長さ。-1 なら空き
+    int pending_index;
+    int finish;           // pending が最後のブロック
+    int stop;
+    int error;            // 圧縮スレッドで起きた最初のエラーの errno
+    unsigned long long submitted;
+    unsigned long long completed;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} CompressedWriterObject;
+
+// 1 ブロック分を圧縮して書き出す。圧縮スレッドで呼ぶ。失敗時は errno を返す
+static int
+CompressedWriter_compress(CompressedWriterObject *self, char *out, const char *data, Py_ssize_t len, int finish,
+                          unsigned long long *written) {
+    int err;
+
+#ifdef HAVE_ZSTD
+    if (self->format == COMPRESS_ZSTD) {
+        ZSTD_inBuffer in = {data, len, 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer o = {out, COMPRESS_OUT_SIZE, 0};
+            remaining = ZSTD_compressStream2(self->zstd, &o, &in, finish ? ZSTD_e_end : ZSTD_e_flush);
+            if (ZSTD_isError(remaining)) {
+                return EIO;
+            }
+            err = write_all(self->fd, out, o.pos);
+            if (err != 0) {
+                return err;
+            }
+            *written += o.pos;
+        } while (remaining != 0);
+        return 0;
+    }
+#endif
+    self->zs.next_in = (Bytef *) data;
+    self->zs.avail_in = (uInt) len;
+    for (;;) {
+        int r;
+        self->zs.next_out = (Bytef *) out;
+        self->zs.avail_out = COMPRESS_OUT_SIZE;
+        r = deflate(&self->zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+        if (r == Z_STREAM_ERROR) {
+            return EIO;
+        }
+        err = write_all(self->fd, out, COMPRESS_OUT_SIZE - self->zs.avail_out);
+        if (err != 0) {
+            return err;
+        }
+        *written += COMPRESS_OUT_SIZE - self->zs.avail_out;
+        // 出力領域を使い切っていなければ、そのブロックの分は出し終えている
+        if (finish ? r == Z_STREAM_END : self->zs.avail_out != 0) {
+            return 0;
+        }
+    }
+}
+
+// 圧縮スレッド本体。Python の API は一切呼ばない
+static void *
+CompressedWriter_thread(void *arg) {
+    CompressedWriterObject *self = arg;
+    char *out = malloc(COMPRESS_OUT_SIZE);
+
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+        Py_ssize_t len;
+        int index, finish, err = 0;
+        unsigned long long written = 0;
+
+        while (self->pending < 0 && !self->stop) {
+            pthread_cond_wait(&self->work, &self->mutex);
+        }
+        if (self->pending < 0) {
+            break;
+        }
+        len = self->pending;
+        index = self->pending_index;
+        finish = self->finish;
+        // エラーの後は読み捨てる。止めると呼び出し側が詰まる
+        if (self->error == 0) {
+            pthread_mutex_unlock(&self->mutex);
+            err = out == NULL ? ENOMEM : CompressedWriter_compress(self, out, self->blocks[index], len, finish, &written);
+            pthread_mutex_lock(&self->mutex);
+        }
+        if (err != 0 && self->error == 0) {
+            self->error = err;
+        }
+        self->bytes_in += len;
+        self->bytes_out += written;
+        self->pending = -1;
+        self->completed++;
+        pthread_cond_broadcast(&self->done);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    free(out);
+    return NULL;
+}
+
+static void
+CompressedWriter_lock(CompressedWriterObject *self) {
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+// 埋めているブロックを圧縮スレッドに渡し、もう一方のブロックに切り替える。lock を持った状態で呼ぶ
+// wait なら渡したブロックの圧縮が終わるまで待つ
+static void
+CompressedWriter_submit(CompressedWriterObject *self, int finish, int wait) {
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->mutex);
+    while (self->pending >= 0) {
+        pthread_cond_wait(&self->done, &self->mutex);
+    }
+    if (self->fill > 0 || finish) {
+        self->pending = self->fill;
+        self->pending_index = self->cur;
+        self->finish = finish;
+        self->submitted++;
+        pthread_cond_signal(&self->work);
+    }
+    if (wait) {
+        while (self->completed != self->submitted) {
+            pthread_cond_wait(&self->done, &self->mutex);
+        }
+    }
+    pthread_mutex_unlock(&self->mutex);
+    Py_END_ALLOW_THREADS
+    self->cur ^= 1;
+    self->fill = 0;
+}
+
+// 圧縮スレッドで起きたエラーがあれば例外にして -1
+static int
+CompressedWriter_raise_error(CompressedWriterObject *self) {
+    int err;
+
+    pthread_mutex_lock(&self->mutex);
+    err = self->error;
+    self->error = 0;
+    pthread_mutex_unlock(&self->mutex);
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+// 残りを圧縮してストリームを終え、スレッドを止める
+static void
+CompressedWriter_shutdown(CompressedWriterObject *self) {
+    CompressedWriter_lock(self);
+    CompressedWriter_submit(self, 1, 1);
+    self->closed = 1;
+    PyThread_release_lock(self->lock);
+    pthread_mutex_lock(&self->mutex);
+    self->stop = 1;
+    pthread_cond_signal(&self->work);
+    pthread_mutex_unlock(&self->mutex);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS
+}
+
+static void
+CompressedWriter_dealloc(CompressedWriterObject *self) {
+    if (self->started) {
+        if (!self->closed) {
+            PyObject *type, *value, *tb;
+            PyErr_Fetch(&type, &value, &tb);
+            CompressedWriter_shutdown(self);
+            if (CompressedWriter_raise_error(self) < 0) {
+                PyErr_WriteUnraisable((PyObject *) self);
+            }
+            PyErr_Restore(type, value, tb);
+        }
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->work);
+        pthread_cond_destroy(&self->done);
+#ifdef HAVE_ZSTD
+        if (self->format == COMPRESS_ZSTD) {
+            ZSTD_freeCCtx(self->zstd);
+        } else
+#endif
+        deflateEnd(&self->zs);
+    }
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+    PyMem_RawFree(self->blocks[0]);
+    PyMem_RawFree(self->blocks[1]);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+CompressedWriter_init(CompressedWriterObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fd", "level", "block_size", "format", NULL};
+    int fd = 1, level = 6, err;
+    Py_ssize_t block_size = 1 << 20;
+    const char *format = "gzip";
+    sigset_t all, old;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iins", kwlist, &fd, &level, &block_size, &format)) {
+        return -1;
+    }
+    if (self->started) {
+        PyErr_SetString(PyExc_RuntimeError, "CompressedWriter is already initialized");
+        return -1;
+    }
+    if (fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "fd must be non-negative");
+        return -1;
+    }
+    if (block_size <= 0 || block_size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be between 1 and 2**31-1");
+        return -1;
+    }
+    if (strcmp(format, "gzip") == 0) {
+        self->format = COMPRESS_GZIP;
+#ifdef HAVE_ZSTD
+    } else if (strcmp(format, "zstd") == 0) {
+        self->format = COMPRESS_ZSTD;
+#endif
+    } else {
+        PyErr_Format(PyExc_ValueError, "unsupported format '%s'", format);
+        return -1;
+    }
+
+    // 前回の __init__ が途中で失敗していれば、ロックは使い回しバッファは確保し直す
+    if (self->lock == NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "cannot allocate lock");
+            return -1;
+        }
+    }
+    // 圧縮スレッドが GIL なしで読むので PyMem_Raw で確保する
+    PyMem_RawFree(self->blocks[0]);
+    PyMem_RawFree(self->blocks[1]);
+    self->blocks[0] = PyMem_RawMalloc(block_size);
+    self->blocks[1] = PyMem_RawMalloc(block_size);
+    if (self->blocks[0] == NULL || self->blocks[1] == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+#ifdef HAVE_ZSTD
+    if (self->format == COMPRESS_ZSTD) {
+        self->zstd = ZSTD_createCCtx();
+        if (self->zstd == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(self->zstd, ZSTD_c_compressionLevel, level))) {
+            ZSTD_freeCCtx(self->zstd);
+            self->zstd = NULL;
+            PyErr_SetString(PyExc_ValueError, "invalid compression level");
+            return -1;
+        }
+    } else
+#endif
+    {
+        // windowBits に 16 を足すと zlib ではなく gzip の形式になる
+        err = deflateInit2(&self->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        if (err != Z_OK) {
+            PyErr_SetString(err == Z_MEM_ERROR ? PyExc_MemoryError : PyExc_ValueError,
+                            err == Z_MEM_ERROR ? "cannot allocate compressor" : "invalid compression level");
+            return -1;
+        }
+    }
+    self->fd = fd;
+    self->level = level;
+    self->block_size = block_size;
+    self->cur = 0;
+    self->fill = 0;
+    self->pending = -1;
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->work, NULL);
+    pthread_cond_init(&self->done, NULL);
+
+    // シグナルは Python のメインスレッドで受けたいので、圧縮スレッドでは全部ブロックしておく
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&self->thread, NULL, CompressedWriter_thread, self);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        pthread_mutex_destroy(&self->mutex);
+        pthread_cond_destroy(&self->work);
+        pthread_cond_destroy(&self->done);
+#ifdef HAVE_ZSTD
+        if (self->format == COMPRESS_ZSTD) {
+            ZSTD_freeCCtx(self->zstd);
+            self->zstd = NULL;
+        } else
+#endif
+        deflateEnd(&self->zs);
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    self->started = 1;
+    return 0;
+}
+
+static int
+CompressedWriter_check(CompressedWriterObject *self) {
+    if (!self->started || self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed CompressedWriter");
+        return -1;
+    }
+    return 0;
+}
+
+// lock を持った状態で呼ぶ。ブロックがいっぱいになるたびに圧縮スレッドへ渡す
+static void
+CompressedWriter_append_locked(CompressedWriterObject *self, const char *data, Py_ssize_t len) {
+    while (len > 0) {
+        Py_ssize_t n = Py_MIN(len, self->block_size - self->fill);
+        memcpy(self->blocks[self->cur] + self->fill, data, n);
+        self->fill += n;
+        data += n;
+        len -= n;
+        if (self->fill == self->block_size) {
+            CompressedWriter_submit(self, 0, 0);
+        }
+    }
+}
 
 static PyObject *
-dumb_print(PyObject *self, PyObject *args) {
+CompressedWriter_print(CompressedWriterObject *self, PyObject *args) {
     const char *text;
-    if (!PyArg_ParseTuple(args, "s", &text)) {
+    Py_ssize_t len;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
         return NULL;
     }
-    printf("%s\n", text);
+    if (CompressedWriter_check(self) < 0) {
+        return NULL;
+    }
+    CompressedWriter_lock(self);
+    // 待っている間に close() されているかもしれない
+    if (self->closed) {
+        PyThread_release_lock(self->lock);
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed CompressedWriter");
+        return NULL;
+    }
+    CompressedWriter_append_locked(self, text, len);
+    CompressedWriter_append_locked(self, "\n", 1);
+    PyThread_release_lock(self->lock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CompressedWriter_flush(CompressedWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (CompressedWriter_check(self) < 0) {
+        return NULL;
+    }
+    CompressedWriter_lock(self);
+    if (!self->closed) {
+        CompressedWriter_submit(self, 0, 1);
+    }
+    PyThread_release_lock(self->lock);
+    if (CompressedWriter_raise_error(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CompressedWriter_close(CompressedWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (!self->started || self->closed) {
+        Py_RETURN_NONE;
+    }
+    // ストリームの終端を書いてスレッドを止める。fd は閉じない
+    CompressedWriter_shutdown(self);
+    if (CompressedWriter_raise_error(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CompressedWriter_enter(CompressedWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (CompressedWriter_check(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+CompressedWriter_exit(CompressedWriterObject *self, PyObject *args) {
+    return CompressedWriter_close(self, NULL);
+}
+
+static PyObject *
+CompressedWriter_getcounter(CompressedWriterObject *self, void *closure) {
+    unsigned long long v;
+
+    if (!self->started) {
+        return PyLong_FromLong(0);
+    }
+    pthread_mutex_lock(&self->mutex);
+    v = *(unsigned long long *) ((char *) self + (size_t) closure);
+    pthread_mutex_unlock(&self->mutex);
+    return PyLong_FromUnsignedLongLong(v);
+}
+
+static PyObject *
+CompressedWriter_getformat(CompressedWriterObject *self, void *closure) {
+    return PyUnicode_FromString(self->format == COMPRESS_ZSTD ? "zstd" : "gzip");
+}
+
+static PyMethodDef CompressedWriter_methods[] = {
+    {"print", (PyCFunction) CompressedWriter_print, METH_VARARGS, "Append text and a newline to the current block"},
+    {"flush", (PyCFunction) CompressedWriter_flush, METH_NOARGS,
+        "Compress and write everything printed so far, ending with a flush point the reader can decode up to"},
+    {"close", (PyCFunction) CompressedWriter_close, METH_NOARGS,
+        "Finish the compressed stream and stop the compression thread. The fd is left open"},
+    {"__enter__", (PyCFunction) CompressedWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) CompressedWriter_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef CompressedWriter_members[] = {
+    {"fd", T_INT, offsetof(CompressedWriterObject, fd), READONLY, "file descriptor written to"},
+    {"level", T_INT, offsetof(CompressedWriterObject, level), READONLY, "compression level"},
+    {"block_size", T_PYSSIZET, offsetof(CompressedWriterObject, block_size), READONLY, "block size in bytes"},
+    {NULL},
+};
+
+static PyGetSetDef CompressedWriter_getsetters[] = {
+    {"bytes_in", (getter) CompressedWriter_getcounter, NULL, "uncompressed bytes processed by the compression thread",
+        (void *) offsetof(CompressedWriterObject, bytes_in)},
+    {"bytes_out", (getter) CompressedWriter_getcounter, NULL, "compressed bytes written to the fd",
+        (void *) offsetof(CompressedWriterObject, bytes_out)},
+    {"format", (getter) CompressedWriter_getformat, NULL, "'gzip' or 'zstd'", NULL},
+    {NULL},
+};
+
+static PyTypeObject CompressedWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.CompressedWriter",
+    .tp_doc = "CompressedWriter(fd=1, level=6, block_size=1048576, format='gzip')\n"
+              "Line writer that compresses on a background thread, flushing the compressor at every block.\n"
+              "format='zstd' is available when the module was built with libzstd.",
+    .tp_basicsize = sizeof(CompressedWriterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) CompressedWriter_init,
+    .tp_dealloc = (destructor) CompressedWriter_dealloc,
+    .tp_methods = CompressedWriter_methods,
+    .tp_members = CompressedWriter_members,
+    .tp_getset = CompressedWriter_getsetters,
+};
+
+// ---- ThreadWriter ----
+// スレッドごとに別のバッファへ溜め、いっぱいになったスレッドが自分のバッファだけを write(2) する
+// 書き込み経路でスレッド間で共有するのは通し番号のカウンタだけ
+// tag が真なら各行の先頭に "通し番号 CLOCK_MONOTONIC のナノ秒 " を付ける。通し番号は 20 桁の 0 埋めなので
+// 出力を sort するか merge_threadlog.py に通せば全体の順序に戻せる
+
+#define SEQ_DIGITS 20
+
+typedef struct ThreadBuffer {
+    struct ThreadBuffer *next;
+    PyThread_type_lock lock;  // 持ち主は write(2) の間 GIL を手放すので、flush() とはこれで排他する
+    char *buf;
+    Py_ssize_t len;
+} ThreadBuffer;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int fd;
+    int tag;
+    Py_ssize_t bufsize;
+    Py_tss_t *key;          // このオブジェクトでのそのスレッドの ThreadBuffer
+    ThreadBuffer *buffers;  // 作ったすべてのバッファ。GIL で守る
+    Py_ssize_t nbuffers;
+    int closed;
+    atomic_ullong seq;
+} ThreadWriterObject;
+
+static void
+ThreadBuffer_lock(ThreadBuffer *tb) {
+    if (!PyThread_acquire_lock(tb->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(tb->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+// tb->lock を持った状態で呼ぶ。失敗時は例外をセットして -1
+static int
+ThreadBuffer_flush_locked(ThreadWriterObject *self, ThreadBuffer *tb) {
+    int err;
+
+    if (tb->len == 0) {
+        return 0;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = write_all(self->fd, tb->buf, tb->len);
+    Py_END_ALLOW_THREADS
+    // バッファはレコードの境目で終わっているので、1 回の write(2) で他のスレッドの行と混ざることはない
+    tb->len = 0;
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+// すべてのスレッドのバッファを書き出す。最初のエラーを例外にする
+static int
+ThreadWriter_flush_all(ThreadWriterObject *self) {
+    ThreadBuffer *tb;
+    int r = 0;
+
+    for (tb = self->buffers; tb != NULL; tb = tb->next) {
+        ThreadBuffer_lock(tb);
+        if (r == 0) {
+            r = ThreadBuffer_flush_locked(self, tb);
+        } else {
+            tb->len = 0;
+        }
+        PyThread_release_lock(tb->lock);
+    }
+    return r;
+}
+
+// 呼び出したスレッドのバッファを返す。初めてならここで作る
+static ThreadBuffer *
+ThreadWriter_buffer(ThreadWriterObject *self) {
+    ThreadBuffer *tb = PyThread_tss_get(self->key);
+
+    if (tb != NULL) {
+        return tb;
+    }
+    tb = PyMem_Calloc(1, sizeof(ThreadBuffer));
+    if (tb == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    tb->buf = PyMem_Malloc(self->bufsize);
+    tb->lock = PyThread_allocate_lock();
+    if (tb->buf == NULL || tb->lock == NULL || PyThread_tss_set(self->key, tb) != 0) {
+        if (tb->lock != NULL) {
+            PyThread_free_lock(tb->lock);
+        }
+        PyMem_Free(tb->buf);
+        PyMem_Free(tb);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    tb->next = self->buffers;
+    self->buffers = tb;
+    self->nbuffers++;
+    return tb;
+}
+
+static void
+ThreadWriter_free_buffers(ThreadWriterObject *self) {
+    ThreadBuffer *tb = self->buffers, *next;
+
+    for (; tb != NULL; tb = next) {
+        next = tb->next;
+        PyThread_free_lock(tb->lock);
+        PyMem_Free(tb->buf);
+        PyMem_Free(tb);
+    }
+    self->buffers = NULL;
+    self->nbuffers = 0;
+}
+
+static void
+ThreadWriter_dealloc(ThreadWriterObject *self) {
+    if (!self->closed && self->buffers != NULL) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        if (ThreadWriter_flush_all(self) < 0) {
+            PyErr_WriteUnraisable((PyObject *) self);
+        }
+        PyErr_Restore(type, value, tb);
+    }
+    ThreadWriter_free_buffers(self);
+    if (self->key != NULL) {
+        PyThread_tss_delete(self->key);
+        PyThread_tss_free(self->key);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+ThreadWriter_init(ThreadWriterObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fd", "bufsize", "tag", NULL};
+    int fd = 1, tag = 1;
+    Py_ssize_t bufsize = 1 << 16;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|inp", kwlist, &fd, &bufsize, &tag)) {
+        return -1;
+    }
+    if (self->key != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "ThreadWriter is already initialized");
+        return -1;
+    }
+    if (fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "fd must be non-negative");
+        return -1;
+    }
+    if (bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return -1;
+    }
+    self->key = PyThread_tss_alloc();
+    if (self->key == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (PyThread_tss_create(self->key) != 0) {
+        PyThread_tss_free(self->key);
+        self->key = NULL;
+        PyErr_SetString(PyExc_RuntimeError, "cannot create thread-specific storage key");
+        return -1;
+    }
+    self->fd = fd;
+    self->tag = tag;
+    self->bufsize = bufsize;
+    atomic_init(&self->seq, 0);
+    return 0;
+}
+
+static int
+ThreadWriter_check(ThreadWriterObject *self) {
+    if (self->key == NULL || self->closed) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed ThreadWriter");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+ThreadWriter_print(ThreadWriterObject *self, PyObject *args) {
+    const char *text;
+    Py_ssize_t len, prefix_len = 0, total;
+    char prefix[SEQ_DIGITS + 24], *end = prefix + sizeof(prefix), *p = end, *digits;
+    ThreadBuffer *tb;
+    int r = 0;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
+        return NULL;
+    }
+    if (ThreadWriter_check(self) < 0) {
+        return NULL;
+    }
+    tb = ThreadWriter_buffer(self);
+    if (tb == NULL) {
+        return NULL;
+    }
+    if (self->tag) {
+        struct timespec ts;
+        unsigned long long seq = atomic_fetch_add_explicit(&self->seq, 1, memory_order_relaxed);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        *--p = ' ';
+        p = format_u64(p, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+        *--p = ' ';
+        digits = format_u64(p, seq);
+        while (p - digits < SEQ_DIGITS) {
+            *--digits = '0';
+        }
+        p = digits;
+        prefix_len = end - p;
+    }
+    total = prefix_len + len + 1;
+
+    ThreadBuffer_lock(tb);
+    // ロックを待つ間は GIL を手放すので、その間に close() が全バッファを書き出し終えていることがある
+    // close() は closed を立ててから各バッファのロックを取るので、ここで見れば取りこぼさない
+    if (self->closed) {
+        PyThread_release_lock(tb->lock);
+        ThreadWriter_check(self);
+        return NULL;
+    }
+    if (tb->len + total > self->bufsize) {
+        r = ThreadBuffer_flush_locked(self, tb);
+    }
+    if (r == 0 && total > self->bufsize) {
+        // バッファに入らない行は 1 回の writev(2) でそのまま書く
+        struct iovec iov[3] = {
+            {(char *) p, prefix_len},
+            {(void *) text, len},
+            {"\n", 1},
+        };
+        int err;
+        Py_BEGIN_ALLOW_THREADS
+        err = writev_all(self->fd, iov, 3);
+        Py_END_ALLOW_THREADS
+        if (err != 0) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+            r = -1;
+        }
+    } else if (r == 0) {
+        memcpy(tb->buf + tb->len, p, prefix_len);
+        memcpy(tb->buf + tb->len + prefix_len, text, len);
+        tb->buf[tb->len + prefix_len + len] = '\n';
+        tb->len += total;
+    }
+    PyThread_release_lock(tb->lock);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ThreadWriter_flush(ThreadWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (ThreadWriter_check(self) < 0) {
+        return NULL;
+    }
+    if (ThreadWriter_flush_all(self) < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ThreadWriter_close(ThreadWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    int r;
+
+    if (self->key == NULL || self->closed) {
+        Py_RETURN_NONE;
+    }
+    // fd は呼び出し元のものなので閉じない
+    self->closed = 1;
+    r = ThreadWriter_flush_all(self);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ThreadWriter_enter(ThreadWriterObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (ThreadWriter_check(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+ThreadWriter_exit(ThreadWriterObject *self, PyObject *args) {
+    return ThreadWriter_close(self, NULL);
+}
+
+static PyObject *
+ThreadWriter_getseq(ThreadWriterObject *self, void *closure) {
+    return PyLong_FromUnsignedLongLong(atomic_load_explicit(&self->seq, memory_order_relaxed));
+}
+
+static PyMethodDef ThreadWriter_methods[] = {
+    {"print", (PyCFunction) ThreadWriter_print, METH_VARARGS, "Append text and a newline to the calling thread's buffer"},
+    {"flush", (PyCFunction) ThreadWriter_flush, METH_NOARGS, "Write the buffers of every thread"},
+    {"close", (PyCFunction) ThreadWriter_close, METH_NOARGS, "Flush every thread's buffer and stop accepting lines. The fd is left open"},
+    {"__enter__", (PyCFunction) ThreadWriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) ThreadWriter_exit, METH_VARARGS, NULL},
+    {NULL},
+};
+
+static PyMemberDef ThreadWriter_members[] = {
+    {"fd", T_INT, offsetof(ThreadWriterObject, fd), READONLY, "file descriptor written to"},
+    {"bufsize", T_PYSSIZET, offsetof(ThreadWriterObject, bufsize), READONLY, "size of each thread's buffer in bytes"},
+    {"threads", T_PYSSIZET, offsetof(ThreadWriterObject, nbuffers), READONLY, "number of threads that have printed"},
+    {NULL},
+};
+
+static PyGetSetDef ThreadWriter_getsetters[] = {
+    {"seq", (getter) ThreadWriter_getseq, NULL, "sequence number of the next tagged line", NULL},
+    {NULL},
+};
+
+static PyTypeObject ThreadWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.ThreadWriter",
+    .tp_doc = "ThreadWriter(fd=1, bufsize=65536, tag=True)\n"
+              "Line writer with one buffer per thread, so printing threads never share a buffer or its lock.\n"
+              "With tag, lines start with a zero-padded sequence number and a CLOCK_MONOTONIC timestamp;\n"
+              "restore the global order with sort or merge_threadlog.py.",
+    .tp_basicsize = sizeof(ThreadWriterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) ThreadWriter_init,
+    .tp_dealloc = (destructor) ThreadWriter_dealloc,
+    .tp_methods = ThreadWriter_methods,
+    .tp_members = ThreadWriter_members,
+    .tp_getset = ThreadWriter_getsetters,
+};
+
+// ---- Limiter ----
+// 呼び出し箇所ごとに 1 つ作り、ログを出す前に allow() で確かめる
+// まず sample の確率で間引き、残ったものをトークンバケットで rate 行/秒、最大 burst 行までに抑える
+// トークンバケットは GCRA で表す。状態は「次の 1 行が理論上許される時刻」tat だけなので、
+// 判定は tat の読み出しと compare-and-swap の 2 回の atomic 操作で済む
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    double rate;
+    double burst;
+    double sample;
+    uint64_t interval;   // 1 行あたりのナノ秒。0 なら流量は無制限
+    uint64_t tolerance;  // tat が現在時刻よりどれだけ先まで進んでよいか
+    uint64_t threshold;  // 乱数がこれ未満なら通す
+    atomic_ullong tat;
+    atomic_ullong rng;
+    atomic_ullong allowed;
+    atomic_ullong limited;
+    atomic_ullong sampled_out;
+} LimiterObject;
+
+static uint64_t
+monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 通すなら 1
+static int
+Limiter_check(LimiterObject *self) {
+    if (self->threshold != UINT64_MAX) {
+        // xorshift64。複数スレッドから同時に呼ばれて同じ値を使うことがあっても、間引きの精度が少し落ちるだけ
+        uint64_t x = atomic_load_explicit(&self->rng, memory_order_relaxed);
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        atomic_store_explicit(&self->rng, x, memory_order_relaxed);
+        if (x >= self->threshold) {
+            atomic_fetch_add_explicit(&self->sampled_out, 1, memory_order_relaxed);
+            return 0;
+        }
+    }
+    if (self->interval != 0) {
+        uint64_t now = monotonic_ns();
+        uint64_t tat = atomic_load_explicit(&self->tat, memory_order_relaxed);
+        for (;;) {
+            uint64_t next = (tat > now ? tat : now) + self->interval;
+            if (next - now > self->tolerance) {
+                atomic_fetch_add_explicit(&self->limited, 1, memory_order_relaxed);
+                return 0;
+            }
+            if (atomic_compare_exchange_weak_explicit(&self->tat, &tat, next,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+    atomic_fetch_add_explicit(&self->allowed, 1, memory_order_relaxed);
+    return 1;
+}
+
+static int
+Limiter_init(LimiterObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"rate", "burst", "sample", NULL};
+    double rate = 0, burst = -1, sample = 1.0;
+    uint64_t seed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ddd", kwlist, &rate, &burst, &sample)) {
+        return -1;
+    }
+    if (!(rate >= 0) || isinf(rate)) {
+        PyErr_SetString(PyExc_ValueError, "rate must be a finite non-negative number (0 means unlimited)");
+        return -1;
+    }
+    if (burst < 0) {
+        burst = rate < 1 ? 1 : rate;
+    }
+    if (!(burst >= 1) || isinf(burst)) {
+        PyErr_SetString(PyExc_ValueError, "burst must be at least 1");
+        return -1;
+    }
+    if (!(sample >= 0 && sample <= 1)) {
+        PyErr_SetString(PyExc_ValueError, "sample must be between 0 and 1");
+        return -1;
+    }
+    self->rate = rate;
+    self->burst = burst;
+    self->sample = sample;
+    self->interval = rate > 0 ? (uint64_t) (1e9 / rate) : 0;
+    if (rate > 0 && self->interval == 0) {
+        self->interval = 1;
+    }
+    // burst 行を一度に通した直後に tat は now + burst * interval まで進む
+    self->tolerance = (uint64_t) (burst * (double) self->interval);
+    self->threshold = sample >= 1 ? UINT64_MAX : (uint64_t) (sample * 18446744073709551616.0);
+    // xorshift は 0 から抜け出せないので 0 以外で始める
+    seed = monotonic_ns() ^ (uint64_t) (uintptr_t) self;
+    atomic_store(&self->rng, seed != 0 ? seed : 0x9e3779b97f4a7c15ULL);
+    atomic_store(&self->tat, 0);
+    atomic_store(&self->allowed, 0);
+    atomic_store(&self->limited, 0);
+    atomic_store(&self->sampled_out, 0);
+    return 0;
+}
+
+static PyObject *
+Limiter_allow(LimiterObject *self, PyObject *Py_UNUSED(ignored)) {
+    return PyBool_FromLong(Limiter_check(self));
+}
+
+static PyObject *
+Limiter_print(LimiterObject *self, PyObject *args) {
+    const char *text;
+    Py_ssize_t len;
+    struct iovec iov[2];
+    int err, parsed = 0;
+
+    // 捨てる行では UTF-8 への変換はしないが、引数の誤りは許可されたかどうかに関係なくエラーにする
+    // str 1 つ以外の呼び出しは珍しいので、先に変換まで済ませてしまう
+    if (PyTuple_GET_SIZE(args) != 1 || !PyUnicode_Check(PyTuple_GET_ITEM(args, 0))) {
+        if (!PyArg_ParseTuple(args, "s#", &text, &len)) {
+            return NULL;
+        }
+        parsed = 1;
+    }
+    if (!Limiter_check(self)) {
+        Py_RETURN_FALSE;
+    }
+    if (!parsed && !PyArg_ParseTuple(args, "s#", &text, &len)) {
+        return NULL;
+    }
+    iov[0].iov_base = (void *) text;
+    iov[0].iov_len = len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    // print() の printf と順番が入れ替わらないように stdio のバッファを先に出す
+    fflush(stdout);
+    err = writev_all(STDOUT_FILENO, iov, 2);
+    if (err != 0) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+Limiter_reset(LimiterObject *self, PyObject *Py_UNUSED(ignored)) {
+    atomic_store(&self->tat, 0);
+    atomic_store(&self->allowed, 0);
+    atomic_store(&self->limited, 0);
+    atomic_store(&self->sampled_out, 0);
     Py_RETURN_NONE;
 }
 
-static static PyMethodDef dumb_print_methods[] = {
+static PyObject *
+Limiter_getcounter(LimiterObject *self, void *closure) {
+    atomic_ullong *counter = (atomic_ullong *) ((char *) self + (size_t) closure);
+    return PyLong_FromUnsignedLongLong(atomic_load_explicit(counter, memory_order_relaxed));
+}
+
+static PyObject *
+Limiter_getsuppressed(LimiterObject *self, void *closure) {
+    return PyLong_FromUnsignedLongLong(atomic_load_explicit(&self->limited, memory_order_relaxed)
+                                       + atomic_load_explicit(&self->sampled_out, memory_order_relaxed));
+}
+
+static PyMethodDef Limiter_methods[] = {
+    {"allow", (PyCFunction) Limiter_allow, METH_NOARGS, "Return True if one more line may be logged now"},
+    {"print", (PyCFunction) Limiter_print, METH_VARARGS,
+        "Print text to stdout if allow() passes. Returns whether it was printed"},
+    {"reset", (PyCFunction) Limiter_reset, METH_NOARGS, "Refill the bucket and zero the counters"},
+    {NULL},
+};
+
+static PyMemberDef Limiter_members[] = {
+    {"rate", T_DOUBLE, offsetof(LimiterObject, rate), READONLY, "lines per second, 0 for no limit"},
+    {"burst", T_DOUBLE, offsetof(LimiterObject, burst), READONLY, "lines that may pass at once"},
+    {"sample", T_DOUBLE, offsetof(LimiterObject, sample), READONLY, "probability that a line is considered at all"},
+    {NULL},
+};
+
+static PyGetSetDef Limiter_getsetters[] = {
+    {"allowed", (getter) Limiter_getcounter, NULL, "lines let through",
+        (void *) offsetof(LimiterObject, allowed)},
+    {"limited", (getter) Limiter_getcounter, NULL, "lines dropped by the rate limit",
+        (void *) offsetof(LimiterObject, limited)},
+    {"sampled_out", (getter) Limiter_getcounter, NULL, "lines dropped by sampling",
+        (void *) offsetof(LimiterObject, sampled_out)},
+    {"suppressed", (getter) Limiter_getsuppressed, NULL, "limited + sampled_out", NULL},
+    {NULL},
+};
+
+static PyTypeObject LimiterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "dumb_print.Limiter",
+    .tp_doc = "Limiter(rate=0, burst=max(rate, 1), sample=1.0)\n"
+              "Per-call-site sampling and token-bucket rate limit for log lines.\n"
+              "Keep one instance per call site and guard the logging call with allow(), or use print().",
+    .tp_basicsize = sizeof(LimiterObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Limiter_init,
+    .tp_methods = Limiter_methods,
+    .tp_members = Limiter_members,
+    .tp_getset = Limiter_getsetters,
+};
+
+static PyMethodDef dumb_print_methods[] = {
     {"print", dumb_print, METH_VARARGS, "Print text"},
+    {"print_bytes", dumb_print_bytes, METH_VARARGS,
+        "Print any bytes-like object followed by a newline, without decoding or copying it"},
+    {"print_many", dumb_print_many, METH_O,
+        "Print every str in an iterable, one per line, with writev(2) in IOV_MAX-sized batches"},
     {NULL, NULL, 0, NULL},
 };
 
@@ -25,5 +3272,85 @@ static struct PyModuleDef dumb_print_module = {
 
 PyMODINIT_FUNC
 PyInit_dumb_print(void) {
-    return PyModule_Create(&dumb_print_module);
+    PyObject *m;
+
+    if (PyType_Ready(&WriterType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&AsyncWriterType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&RingLogType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&TemplateType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&CompressedWriterType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&ThreadWriterType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&LimiterType) < 0) {
+        return NULL;
+    }
+    // PyType_Ready() を呼ぶ前に tp_base を埋めておく
+    BinaryLogType.tp_base = &WriterType;
+    if (PyType_Ready(&BinaryLogType) < 0) {
+        return NULL;
+    }
+    m = PyModule_Create(&dumb_print_module);
+    if (m == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&WriterType);
+    if (PyModule_AddObject(m, "Writer", (PyObject *) &WriterType) < 0) {
+        Py_DECREF(&WriterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&AsyncWriterType);
+    if (PyModule_AddObject(m, "AsyncWriter", (PyObject *) &AsyncWriterType) < 0) {
+        Py_DECREF(&AsyncWriterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&BinaryLogType);
+    if (PyModule_AddObject(m, "BinaryLog", (PyObject *) &BinaryLogType) < 0) {
+        Py_DECREF(&BinaryLogType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&RingLogType);
+    if (PyModule_AddObject(m, "RingLog", (PyObject *) &RingLogType) < 0) {
+        Py_DECREF(&RingLogType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&TemplateType);
+    if (PyModule_AddObject(m, "Template", (PyObject *) &TemplateType) < 0) {
+        Py_DECREF(&TemplateType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&CompressedWriterType);
+    if (PyModule_AddObject(m, "CompressedWriter", (PyObject *) &CompressedWriterType) < 0) {
+        Py_DECREF(&CompressedWriterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ThreadWriterType);
+    if (PyModule_AddObject(m, "ThreadWriter", (PyObject *) &ThreadWriterType) < 0) {
+        Py_DECREF(&ThreadWriterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&LimiterType);
+    if (PyModule_AddObject(m, "Limiter", (PyObject *) &LimiterType) < 0) {
+        Py_DECREF(&LimiterType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
 }
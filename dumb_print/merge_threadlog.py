@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Restore the global order of lines written by dumb_print.ThreadWriter.
+
+usage: merge_threadlog.py [--strip] [FILE ...]
+
+Each tagged line starts with a zero-padded sequence number and a
+CLOCK_MONOTONIC timestamp in nanoseconds. Lines from all FILEs (or
+stdin) are sorted by sequence number. With --strip both tags are
+removed from the output. Untagged lines are kept in their original
+order after the tagged ones.
+"""
+
+import argparse
+import sys
+
+
+def merge(streams, strip=False):
+    """Yield the lines of every stream in sequence-number order."""
+    tagged = []
+    untagged = []
+    for stream in streams:
+        for line in stream:
+            seq, _, rest = line.partition(b" ")
+            if seq.isdigit() and rest:
+                tagged.append((int(seq), line))
+            else:
+                untagged.append(line)
+    # 通し番号は重複しないので行全体の比較にはならない
+    tagged.sort(key=lambda item: item[0])
+    for _, line in tagged:
+        if strip:
+            line = line.split(b" ", 2)[2]
+        yield line
+    yield from untagged
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Restore the global order of dumb_print.ThreadWriter output.")
+    parser.add_argument("files", nargs="*", metavar="FILE")
+    parser.add_argument("--strip", action="store_true", help="remove the sequence number and timestamp")
+    args = parser.parse_args()
+
+    streams = []
+    for name in args.files or ["-"]:
+        streams.append(sys.stdin.buffer if name == "-" else open(name, "rb"))
+    out = sys.stdout.buffer
+    for line in merge(streams, args.strip):
+        out.write(line)
+        if not line.endswith(b"\n"):
+            out.write(b"\n")
+    for stream in streams:
+        if stream is not sys.stdin.buffer:
+            stream.close()
+
+
+if __name__ == "__main__":
+    main()
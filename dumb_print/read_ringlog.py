@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Print the records held in a dumb_print.RingLog file, oldest first.
+
+usage: read_ringlog.py [--timestamps] [--seq] FILE
+
+The file can be read while a process is still writing to it or after
+it has crashed. A record that was being written when the process died
+is not included. Must run on a host with the writer's byte order.
+"""
+
+import argparse
+import datetime
+import struct
+import sys
+
+MAGIC = b"DPRING1\0"
+HEADER = struct.Struct("=8sQQQQ24x")
+RECORD = struct.Struct("=IIQQ")
+RECORD_PAD = 1
+
+
+def align(n):
+    return (n + 7) & ~7
+
+
+def records(data):
+    """Yield (seq, time_ns, payload) for every live record in data."""
+    magic, cap, head, tail, _ = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError("not a RingLog file")
+    ring = memoryview(data)[HEADER.size:HEADER.size + cap]
+    pos = tail
+    last = None
+    while pos < head:
+        p = pos % cap
+        # 終わりにヘッダが入らない隙間と埋め草は飛ばして先頭に戻る
+        if cap - p < RECORD.size:
+            pos += cap - p
+            continue
+        length, kind, seq, ns = RECORD.unpack_from(ring, p)
+        if kind == RECORD_PAD:
+            pos += cap - p
+            continue
+        end = pos + RECORD.size + align(length)
+        if end > head or p + RECORD.size + length > cap:
+            break
+        # 書き込み中に読んだ場合、tail の先が既に上書きされていることがある
+        if last is not None and seq != last + 1:
+            break
+        last = seq
+        yield seq, ns, bytes(ring[p + RECORD.size:p + RECORD.size + length])
+        pos = end
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print the records held in a dumb_print.RingLog file.")
+    parser.add_argument("file")
+    parser.add_argument("--timestamps", action="store_true", help="prefix each record with its time")
+    parser.add_argument("--seq", action="store_true", help="prefix each record with its sequence number")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+    out = sys.stdout.buffer
+    for seq, ns, payload in records(data):
+        if args.seq:
+            out.write(b"%d " % seq)
+        if args.timestamps:
+            when = datetime.datetime.fromtimestamp(ns // 1000000000)
+            out.write(("%s.%09d " % (when.isoformat(), ns % 1000000000)).encode())
+        out.write(payload)
+        out.write(b"\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,19 @@
+import os
 from distutils.core import setup, Extension
 
+# zstd.h があれば CompressedWriter で format='zstd' も使えるようにする
+include_dirs = ["/usr/include", "/usr/local/include"]
+have_zstd = any(os.path.exists(os.path.join(d, "zstd.h")) for d in include_dirs)
 
 setup(
     name="dumb_print",
     version="1.0",
-    ext_modules=[Extension("dumb_print", ["dumb_print.c"])],
+    ext_modules=[
+        Extension(
+            "dumb_print",
+            ["dumb_print.c"],
+            libraries=["z"] + (["zstd"] if have_zstd else []),
+            define_macros=[("HAVE_ZSTD", "1")] if have_zstd else [],
+        )
+    ],
 )
@@ -1,24 +1,3377 @@
 #define PY_SSIZE_T_CLEAN
 
 #include <Python.h>
+#include "structmember.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// pidfd を使うので Linux (5.3 以降) でのみ有効にする
+#define SPAM_HAVE_PIDFD 1
+#endif
 
 static PyObject *SpamError;
 
+#ifdef SPAM_HAVE_PIDFD
+static PyObject *spam_system_supervised(const char *command, double timeout, PyObject *cancel);
+#endif
+
+// O& 用の変換関数。timeout 引数を秒数の double にする。None なら -1.0 (タイムアウトなし)
+// NaN は比較がすべて偽になり「タイムアウトなし」として通ってしまうので、>= 0 の否定で弾く
+// time_t に収まらない値はキャストが未定義動作になるので受け付けない
+static int
+spam_timeout_converter(PyObject *obj, void *addr) {
+    double *timeout = addr;
+
+    if (obj == Py_None) {
+        *timeout = -1.0;
+        return 1;
+    }
+    *timeout = PyFloat_AsDouble(obj);
+    if (*timeout == -1.0 && PyErr_Occurred()) {
+        return 0;
+    }
+    if (!(*timeout >= 0)) {
+        PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+        return 0;
+    }
+    if (*timeout >= (double) LLONG_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "timeout is too large");
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *
+spam_system(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"command", "timeout", "cancel", NULL};
+    const char *command;
+    PyObject *cancel = Py_None;
+    double timeout = -1.0;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|O&O", kwlist, &command,
+                                     spam_timeout_converter, &timeout, &cancel)) {
+        return NULL;
+    }
+    // タイムアウトもキャンセルも指定されなければ従来どおり system() を呼ぶ
+    if (timeout < 0 && cancel == Py_None) {
+        Py_BEGIN_ALLOW_THREADS
+        status = system(command);
+        Py_END_ALLOW_THREADS
+        return PyLong_FromLong(status);
+    }
+#ifdef SPAM_HAVE_PIDFD
+    return spam_system_supervised(command, timeout, cancel);
+#else
+    PyErr_SetString(PyExc_NotImplementedError, "timeout and cancel require pidfd support");
+    return NULL;
+#endif
+}
+
+#ifdef SPAM_HAVE_PIDFD
+
+extern char **environ;
+
+// 出力の読み込み単位。bytes の容量が足りなくなったらこの単位以上で伸ばす
+#define SPAM_READ_CHUNK 65536
+// キャプチャ用パイプに設定するバッファサイズ
+#define SPAM_PIPE_SIZE (1024 * 1024)
+
+static int
+spam_pidfd_open(pid_t pid) {
+    // glibc 2.36 未満にはラッパーがないので直接呼ぶ
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void
+spam_argv_free(char **argv) {
+    if (argv == NULL) {
+        return;
+    }
+    for (char **p = argv; *p != NULL; p++) {
+        free(*p);
+    }
+    free(argv);
+}
+
+// str / bytes は system() と同じく /bin/sh -c で、それ以外のシーケンスは argv としてそのまま exec する
+// GIL を解放したまま使えるように、文字列はすべて malloc した領域にコピーしておく
+static char **
+spam_argv_from_object(PyObject *command) {
+    PyObject *seq, *item, *converted;
+    Py_ssize_t n, i;
+    char **argv;
+
+    if (PyUnicode_Check(command) || PyBytes_Check(command)) {
+        if (!PyUnicode_FSConverter(command, &converted)) {
+            return NULL;
+        }
+        argv = calloc(4, sizeof(char *));
+        if (argv == NULL) {
+            Py_DECREF(converted);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        argv[0] = strdup("/bin/sh");
+        argv[1] = strdup("-c");
+        argv[2] = strdup(PyBytes_AS_STRING(converted));
+        Py_DECREF(converted);
+        if (argv[0] == NULL || argv[1] == NULL || argv[2] == NULL) {
+            spam_argv_free(argv);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        return argv;
+    }
+
+    seq = PySequence_Fast(command, "command must be a str or a sequence of arguments");
+    if (seq == NULL) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "argv must not be empty");
+        return NULL;
+    }
+    argv = calloc(n + 1, sizeof(char *));
+    if (argv == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyUnicode_FSConverter(item, &converted)) {
+            Py_DECREF(seq);
+            spam_argv_free(argv);
+            return NULL;
+        }
+        argv[i] = strdup(PyBytes_AS_STRING(converted));
+        Py_DECREF(converted);
+        if (argv[i] == NULL) {
+            Py_DECREF(seq);
+            spam_argv_free(argv);
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return argv;
+}
+
+// 子プロセスを起動する。-1 を渡した標準入出力は親のものを引き継ぐ
+// 戻り値は 0 か errno。glibc の posix_spawn は CLONE_VFORK を使うので親のメモリ量に依らず速い
+// new_pgroup が真なら子を新しいプロセスグループのリーダーにする
+static int
+spam_spawn(char *const argv[], int stdin_fd, int stdout_fd, int stderr_fd, int new_pgroup, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    int err;
+
+    err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        return err;
+    }
+    err = posix_spawnattr_init(&attr);
+    if (err != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return err;
+    }
+    // Python は SIGPIPE などを無視しているので、子ではシェルと同じくデフォルトに戻す
+    // (戻さないとパイプラインの前段が EPIPE で失敗扱いになる)
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    sigaddset(&sigdefault, SIGXFSZ);
+    if ((err = posix_spawnattr_setsigdefault(&attr, &sigdefault)) != 0
+        || (err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF
+                                                  | (new_pgroup ? POSIX_SPAWN_SETPGROUP : 0))) != 0
+        || (err = posix_spawnattr_setpgroup(&attr, 0)) != 0) {
+        goto done;
+    }
+    if (stdin_fd >= 0 && (err = posix_spawn_file_actions_adddup2(&actions, stdin_fd, 0)) != 0) {
+        goto done;
+    }
+    if (stdout_fd >= 0 && (err = posix_spawn_file_actions_adddup2(&actions, stdout_fd, 1)) != 0) {
+        goto done;
+    }
+    if (stderr_fd >= 0 && (err = posix_spawn_file_actions_adddup2(&actions, stderr_fd, 2)) != 0) {
+        goto done;
+    }
+    err = posix_spawnp(pid, argv[0], &actions, &attr, argv, environ);
+done:
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+// ---- rusage の集計 ----
+// spam から起動した子はすべて wait4() で回収し、rusage をモジュール全体で合算する
+
+typedef struct {
+    long long commands;
+    double wall_time;
+    double user_time;
+    double system_time;
+    long max_rss;  // KiB。合計ではなく最大値
+    long long minor_faults;
+    long long major_faults;
+    long long voluntary_switches;
+    long long involuntary_switches;
+} SpamUsage;
+
+// GIL を解放したまま回収するスレッドがあるのでミューテックスで守る
+static SpamUsage spam_usage_totals;
+static pthread_mutex_t spam_usage_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+spam_monotonic(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static double
+spam_timeval_seconds(struct timeval tv) {
+    return (double) tv.tv_sec + (double) tv.tv_usec * 1e-6;
+}
+
+static void
+spam_usage_add(const struct rusage *ru, double wall_time) {
+    pthread_mutex_lock(&spam_usage_lock);
+    spam_usage_totals.commands++;
+    spam_usage_totals.wall_time += wall_time;
+    spam_usage_totals.user_time += spam_timeval_seconds(ru->ru_utime);
+    spam_usage_totals.system_time += spam_timeval_seconds(ru->ru_stime);
+    if (ru->ru_maxrss > spam_usage_totals.max_rss) {
+        spam_usage_totals.max_rss = ru->ru_maxrss;
+    }
+    spam_usage_totals.minor_faults += ru->ru_minflt;
+    spam_usage_totals.major_faults += ru->ru_majflt;
+    spam_usage_totals.voluntary_switches += ru->ru_nvcsw;
+    spam_usage_totals.involuntary_switches += ru->ru_nivcsw;
+    pthread_mutex_unlock(&spam_usage_lock);
+}
+
+// waitpid() の代わりに使う。回収できたら start からの経過時間と rusage を集計に加える
+// ru が NULL でなければ子の rusage を書き込む。ブロックする場合は EINTR で再試行する
+static pid_t
+spam_wait(pid_t pid, int *status, int options, double start, struct rusage *ru) {
+    struct rusage usage;
+    pid_t r;
+
+    do {
+        r = wait4(pid, status, options, &usage);
+    } while (r < 0 && errno == EINTR && !(options & WNOHANG));
+    if (r > 0) {
+        spam_usage_add(&usage, spam_monotonic() - start);
+        if (ru != NULL) {
+            *ru = usage;
+        }
+    }
+    return r;
+}
+
+typedef struct {
+    char **argv;
+    pid_t pid;          // 終了を回収したら 0
+    int pidfd;
+    int out_fd;         // capture 時の読み込み側パイプ。EOF を読んだら -1
+    int status;         // waitpid() の status。system() の戻り値と同じ形式
+    PyObject *output;   // capture 時の読み込み先。容量は PyBytes_GET_SIZE で、実データは out_len まで
+    Py_ssize_t out_len;
+    double start;       // CLOCK_MONOTONIC での起動時刻と回収時刻
+    double end;
+} SpamJob;
+
+typedef struct SpamRunner {
+    SpamJob *jobs;
+    Py_ssize_t njobs;
+    Py_ssize_t *ready;      // 起動待ちのジョブ番号 (起動順)
+    Py_ssize_t nready;
+    Py_ssize_t next_ready;
+    Py_ssize_t running;     // 終了または EOF を待っているジョブ数
+    Py_ssize_t max_parallel;
+    int capture;
+    int epfd;
+    int spawn_errno;        // 起動に失敗したらそれ以降は起動しない
+    Py_ssize_t spawn_failed;
+    int failed;             // Python の例外がセット済み
+    PyThreadState *tstate;  // GIL を解放している間のスレッド状態
+    // ジョブが終わるたびに GIL を解放したまま呼ばれる。ready にジョブを追加してよい
+    void (*on_finished)(struct SpamRunner *runner, Py_ssize_t index);
+    void *context;
+} SpamRunner;
+
+// epoll に登録するデータ。下位 1 ビットでパイプか pidfd かを区別する
+#define SPAM_EV_PIPE 1
+#define SPAM_EV_DATA(index, kind) (((uint64_t) (index) << 1) | (kind))
+
+static int
+spam_job_finished(SpamJob *job) {
+    return job->pid == 0 && job->out_fd < 0;
+}
+
+// fd から *output へ直接 read() する。bytes の中身へ書き込むのでユーザ空間でのコピーは発生しない
+// GIL を解放したまま呼び、容量を伸ばすときだけ *tstate を使って GIL を取り直す
+// 戻り値は読んだバイト数、EOF なら 0、例外をセットした場合は -1
+static Py_ssize_t
+spam_read_into(int fd, PyObject **output, Py_ssize_t *len, PyThreadState **tstate) {
+    Py_ssize_t capacity = *output == NULL ? 0 : PyBytes_GET_SIZE(*output);
+    ssize_t n;
+
+    if (capacity - *len < SPAM_READ_CHUNK) {
+        // 大きな bytes は mmap された領域なので、realloc は mremap になり中身はコピーされない
+        PyEval_RestoreThread(*tstate);
+        if (*output == NULL) {
+            *output = PyBytes_FromStringAndSize(NULL, SPAM_READ_CHUNK);
+        } else if (_PyBytes_Resize(output, capacity * 2) < 0) {
+            *output = NULL;
+        }
+        *tstate = PyEval_SaveThread();
+        if (*output == NULL) {
+            return -1;
+        }
+        capacity = PyBytes_GET_SIZE(*output);
+    }
+    do {
+        n = read(fd, PyBytes_AS_STRING(*output) + *len, capacity - *len);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        *len += n;
+    }
+    // 読み込みエラーは EOF と同じ扱いにする (子の終了ステータスで判断する)
+    return n < 0 ? 0 : n;
+}
+
+static int
+spam_runner_read(SpamRunner *runner, SpamJob *job) {
+    Py_ssize_t n = spam_read_into(job->out_fd, &job->output, &job->out_len, &runner->tstate);
+
+    if (n < 0) {
+        runner->failed = 1;
+        return -1;
+    }
+    if (n == 0) {
+        close(job->out_fd);
+        job->out_fd = -1;
+    }
+    return 0;
+}
+
+// 出力キャプチャ用のパイプを作る。パイプのバッファを大きくして read() とコンテキストスイッチの回数を減らす
+static int
+spam_capture_pipe(int pipefd[2]) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    // 上限 (/proc/sys/fs/pipe-max-size) を超えると失敗するが、その場合はデフォルトのままで良い
+    fcntl(pipefd[0], F_SETPIPE_SZ, SPAM_PIPE_SIZE);
+    return 0;
+}
+
+static void
+spam_runner_reap(SpamJob *job) {
+    spam_wait(job->pid, &job->status, 0, job->start, NULL);
+    job->end = spam_monotonic();
+    close(job->pidfd);
+    job->pidfd = -1;
+    job->pid = 0;
+}
+
+static int
+spam_runner_launch(SpamRunner *runner, Py_ssize_t index) {
+    SpamJob *job = &runner->jobs[index];
+    struct epoll_event ev;
+    int pipefd[2] = {-1, -1};
+    int err;
+
+    if (runner->capture && spam_capture_pipe(pipefd) < 0) {
+        return errno;
+    }
+    job->start = spam_monotonic();
+    err = spam_spawn(job->argv, -1, pipefd[1], -1, 0, &job->pid);
+    if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+    }
+    if (err != 0) {
+        if (pipefd[0] >= 0) {
+            close(pipefd[0]);
+        }
+        job->pid = 0;
+        return err;
+    }
+    job->out_fd = pipefd[0];
+    job->pidfd = spam_pidfd_open(job->pid);
+    if (job->pidfd < 0) {
+        // pidfd が使えなくても子は起動済みなので、回収だけはしておく
+        err = errno;
+        kill(job->pid, SIGKILL);
+        spam_runner_reap(job);
+        if (job->out_fd >= 0) {
+            close(job->out_fd);
+            job->out_fd = -1;
+        }
+        return err;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = SPAM_EV_DATA(index, 0);
+    if (epoll_ctl(runner->epfd, EPOLL_CTL_ADD, job->pidfd, &ev) < 0) {
+        goto error;
+    }
+    if (job->out_fd >= 0) {
+        ev.data.u64 = SPAM_EV_DATA(index, SPAM_EV_PIPE);
+        if (epoll_ctl(runner->epfd, EPOLL_CTL_ADD, job->out_fd, &ev) < 0) {
+            goto error;
+        }
+    }
+    runner->running++;
+    return 0;
+error:
+    // 登録できなければ終了を知る手段がなく epoll_wait が戻らなくなるので、起動失敗として扱う
+    // fd を閉じれば epoll からも外れる
+    err = errno;
+    kill(job->pid, SIGKILL);
+    spam_runner_reap(job);
+    if (job->out_fd >= 0) {
+        close(job->out_fd);
+        job->out_fd = -1;
+    }
+    return err;
+}
+
+// 実行中の子をすべて殺して回収する。例外発生時の後始末用
+static void
+spam_runner_abort(SpamRunner *runner) {
+    for (Py_ssize_t i = 0; i < runner->njobs; i++) {
+        SpamJob *job = &runner->jobs[i];
+        if (job->pid != 0) {
+            kill(job->pid, SIGKILL);
+            spam_runner_reap(job);
+        }
+        if (job->out_fd >= 0) {
+            close(job->out_fd);
+            job->out_fd = -1;
+        }
+    }
+    runner->running = 0;
+}
+
+// ジョブを max_parallel 個ずつ起動し、pidfd とパイプを 1 つの epoll で待つ
+// GIL を持った状態で呼び出し、失敗時は例外をセットして -1 を返す
+static int
+spam_runner_run(SpamRunner *runner) {
+    struct epoll_event events[64];
+    int n, i;
+
+    runner->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (runner->epfd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    runner->tstate = PyEval_SaveThread();
+    for (;;) {
+        while (!runner->failed && runner->spawn_errno == 0
+               && runner->running < runner->max_parallel && runner->next_ready < runner->nready) {
+            Py_ssize_t index = runner->ready[runner->next_ready++];
+            int err = spam_runner_launch(runner, index);
+            if (err != 0) {
+                runner->spawn_errno = err;
+                runner->spawn_failed = index;
+            }
+        }
+        if (runner->failed || runner->running == 0) {
+            break;
+        }
+        n = epoll_wait(runner->epfd, events, 64, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                PyEval_RestoreThread(runner->tstate);
+                PyErr_SetFromErrno(PyExc_OSError);
+                runner->tstate = PyEval_SaveThread();
+                runner->failed = 1;
+                break;
+            }
+            // Ctrl-C などは Python 側で処理させる
+            PyEval_RestoreThread(runner->tstate);
+            if (PyErr_CheckSignals() < 0) {
+                runner->failed = 1;
+            }
+            runner->tstate = PyEval_SaveThread();
+            continue;
+        }
+        for (i = 0; i < n && !runner->failed; i++) {
+            Py_ssize_t index = (Py_ssize_t) (events[i].data.u64 >> 1);
+            SpamJob *job = &runner->jobs[index];
+            if (events[i].data.u64 & SPAM_EV_PIPE) {
+                if (job->out_fd < 0 || spam_runner_read(runner, job) < 0) {
+                    continue;
+                }
+            } else if (job->pid != 0) {
+                spam_runner_reap(job);
+            } else {
+                continue;
+            }
+            if (spam_job_finished(job)) {
+                runner->running--;
+                if (runner->on_finished != NULL) {
+                    runner->on_finished(runner, index);
+                }
+            }
+        }
+    }
+    if (runner->failed) {
+        spam_runner_abort(runner);
+    }
+    PyEval_RestoreThread(runner->tstate);
+    close(runner->epfd);
+    runner->epfd = -1;
+    if (runner->failed) {
+        return -1;
+    }
+    if (runner->spawn_errno != 0) {
+        errno = runner->spawn_errno;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, runner->jobs[runner->spawn_failed].argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+spam_runner_free(SpamRunner *runner) {
+    if (runner->jobs != NULL) {
+        for (Py_ssize_t i = 0; i < runner->njobs; i++) {
+            spam_argv_free(runner->jobs[i].argv);
+            Py_XDECREF(runner->jobs[i].output);
+        }
+    }
+    PyMem_Free(runner->jobs);
+    PyMem_Free(runner->ready);
+}
+
+// commands から SpamRunner を組み立てる。起動順は commands の順
+static int
+spam_runner_init(SpamRunner *runner, PyObject *commands, Py_ssize_t max_parallel, int capture) {
+    PyObject *seq;
+    Py_ssize_t i;
+
+    memset(runner, 0, sizeof(*runner));
+    runner->epfd = -1;
+    runner->capture = capture;
+    if (max_parallel <= 0) {
+        max_parallel = sysconf(_SC_NPROCESSORS_ONLN);
+        if (max_parallel <= 0) {
+            max_parallel = 1;
+        }
+    }
+    runner->max_parallel = max_parallel;
+
+    seq = PySequence_Fast(commands, "commands must be a sequence");
+    if (seq == NULL) {
+        return -1;
+    }
+    runner->njobs = PySequence_Fast_GET_SIZE(seq);
+    runner->jobs = PyMem_Calloc(runner->njobs ? runner->njobs : 1, sizeof(SpamJob));
+    runner->ready = PyMem_Calloc(runner->njobs ? runner->njobs : 1, sizeof(Py_ssize_t));
+    if (runner->jobs == NULL || runner->ready == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < runner->njobs; i++) {
+        SpamJob *job = &runner->jobs[i];
+        job->pidfd = -1;
+        job->out_fd = -1;
+        job->argv = spam_argv_from_object(PySequence_Fast_GET_ITEM(seq, i));
+        if (job->argv == NULL) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        runner->ready[runner->nready++] = i;
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+// spam_read_into() で読み込んだ bytes を実際の長さに切り詰めて返す。所有権は呼び出し元に移る
+static PyObject *
+spam_take_output(PyObject **output, Py_ssize_t len) {
+    PyObject *result = *output;
+
+    *output = NULL;
+    if (result == NULL) {
+        return PyBytes_FromStringAndSize(NULL, 0);
+    }
+    if (_PyBytes_Resize(&result, len) < 0) {
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+spam_run_many(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"commands", "max_parallel", "capture", NULL};
+    PyObject *commands, *result = NULL, *item;
+    Py_ssize_t max_parallel = 0;
+    int capture = 0;
+    SpamRunner runner;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|np", kwlist, &commands, &max_parallel, &capture)) {
+        return NULL;
+    }
+    if (spam_runner_init(&runner, commands, max_parallel, capture) < 0) {
+        goto done;
+    }
+    if (spam_runner_run(&runner) < 0) {
+        goto done;
+    }
+    result = PyList_New(runner.njobs);
+    if (result == NULL) {
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < runner.njobs; i++) {
+        SpamJob *job = &runner.jobs[i];
+        if (capture) {
+            PyObject *output = spam_take_output(&job->output, job->out_len);
+            item = output == NULL ? NULL : Py_BuildValue("(iN)", job->status, output);
+        } else {
+            item = PyLong_FromLong(job->status);
+        }
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+done:
+    spam_runner_free(&runner);
+    return result;
+}
+
+// ---- run_graph ----
+// 依存関係のあるコマンドを、依存先がすべて成功した時点で SpamRunner のキューに積む
+
+typedef struct {
+    Py_ssize_t *indegree;    // 未完了の依存先の数
+    Py_ssize_t *edge_start;  // dependents の CSR 形式の添字。edge_start[i] から edge_start[i + 1] まで
+    Py_ssize_t *dependents;  // 各ジョブに依存しているジョブ
+    Py_ssize_t *order;       // トポロジカル順
+} SpamGraph;
+
+// SpamRunner から GIL を解放したまま呼ばれる
+static void
+spam_graph_on_finished(SpamRunner *runner, Py_ssize_t index) {
+    SpamGraph *graph = runner->context;
+
+    // 失敗したジョブに依存するものは起動しない (スキップ扱い)
+    if (runner->jobs[index].status != 0) {
+        return;
+    }
+    for (Py_ssize_t e = graph->edge_start[index]; e < graph->edge_start[index + 1]; e++) {
+        Py_ssize_t dependent = graph->dependents[e];
+        if (--graph->indegree[dependent] == 0) {
+            runner->ready[runner->nready++] = dependent;
+        }
+    }
+}
+
+static void
+spam_graph_free(SpamGraph *graph) {
+    PyMem_Free(graph->indegree);
+    PyMem_Free(graph->edge_start);
+    PyMem_Free(graph->dependents);
+    PyMem_Free(graph->order);
+}
+
+// names の順番をジョブ番号として依存グラフを組み立て、循環があれば ValueError にする
+static int
+spam_graph_init(SpamGraph *graph, PyObject *names, PyObject *deps) {
+    PyObject *index = NULL, *edges = NULL, *item, *dep, *pos;
+    Py_ssize_t n = PyList_GET_SIZE(names), nedges = 0, i, j, head = 0, tail = 0;
+    Py_ssize_t *fill = NULL, *indegree = NULL;
+    int result = -1;
+
+    memset(graph, 0, sizeof(*graph));
+    graph->indegree = PyMem_Calloc(n + 1, sizeof(Py_ssize_t));
+    graph->edge_start = PyMem_Calloc(n + 2, sizeof(Py_ssize_t));
+    graph->order = PyMem_Calloc(n + 1, sizeof(Py_ssize_t));
+    fill = PyMem_Calloc(n + 1, sizeof(Py_ssize_t));
+    indegree = PyMem_Calloc(n + 1, sizeof(Py_ssize_t));
+    index = PyDict_New();
+    // edges[i] は (依存先, 依存元) の組のリスト
+    edges = PyList_New(0);
+    if (graph->indegree == NULL || graph->edge_start == NULL || graph->order == NULL
+        || fill == NULL || indegree == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (index == NULL || edges == NULL) {
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        pos = PyLong_FromSsize_t(i);
+        if (pos == NULL || PyDict_SetItem(index, PyList_GET_ITEM(names, i), pos) < 0) {
+            Py_XDECREF(pos);
+            goto done;
+        }
+        Py_DECREF(pos);
+    }
+    // ジョブにない名前の依存関係は書き間違いなので、黙って無視せずエラーにする
+    if (deps != NULL && deps != Py_None) {
+        PyObject *it = PyObject_GetIter(deps), *key;
+        if (it == NULL) {
+            goto done;
+        }
+        while ((key = PyIter_Next(it)) != NULL) {
+            int found = PyDict_Contains(index, key);
+            if (found == 0) {
+                PyErr_Format(PyExc_KeyError, "dependencies given for unknown job %R", key);
+            }
+            Py_DECREF(key);
+            if (found <= 0) {
+                break;
+            }
+        }
+        Py_DECREF(it);
+        if (PyErr_Occurred()) {
+            goto done;
+        }
+    }
+    for (i = 0; deps != NULL && deps != Py_None && i < n; i++) {
+        PyObject *seq;
+        item = PyObject_GetItem(deps, PyList_GET_ITEM(names, i));
+        if (item == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                goto done;
+            }
+            PyErr_Clear();
+            continue;
+        }
+        seq = PySequence_Fast(item, "dependencies must be a sequence of job names");
+        Py_DECREF(item);
+        if (seq == NULL) {
+            goto done;
+        }
+        for (j = 0; j < PySequence_Fast_GET_SIZE(seq); j++) {
+            dep = PySequence_Fast_GET_ITEM(seq, j);
+            pos = PyDict_GetItemWithError(index, dep);
+            if (pos == NULL) {
+                if (!PyErr_Occurred()) {
+                    PyErr_Format(PyExc_KeyError, "unknown dependency %R of job %R", dep, PyList_GET_ITEM(names, i));
+                }
+                Py_DECREF(seq);
+                goto done;
+            }
+            item = Py_BuildValue("(On)", pos, i);
+            if (item == NULL || PyList_Append(edges, item) < 0) {
+                Py_XDECREF(item);
+                Py_DECREF(seq);
+                goto done;
+            }
+            Py_DECREF(item);
+            graph->edge_start[PyLong_AsSsize_t(pos) + 1]++;
+            graph->indegree[i]++;
+            nedges++;
+        }
+        Py_DECREF(seq);
+    }
+
+    graph->dependents = PyMem_Calloc(nedges + 1, sizeof(Py_ssize_t));
+    if (graph->dependents == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        graph->edge_start[i + 1] += graph->edge_start[i];
+    }
+    for (j = 0; j < nedges; j++) {
+        PyObject *edge = PyList_GET_ITEM(edges, j);
+        Py_ssize_t from = PyLong_AsSsize_t(PyTuple_GET_ITEM(edge, 0));
+        Py_ssize_t to = PyLong_AsSsize_t(PyTuple_GET_ITEM(edge, 1));
+        graph->dependents[graph->edge_start[from] + fill[from]++] = to;
+    }
+
+    // Kahn のアルゴリズムで循環を検出し、トポロジカル順も作っておく
+    memcpy(indegree, graph->indegree, n * sizeof(Py_ssize_t));
+    for (i = 0; i < n; i++) {
+        if (indegree[i] == 0) {
+            graph->order[tail++] = i;
+        }
+    }
+    while (head < tail) {
+        i = graph->order[head++];
+        for (j = graph->edge_start[i]; j < graph->edge_start[i + 1]; j++) {
+            if (--indegree[graph->dependents[j]] == 0) {
+                graph->order[tail++] = graph->dependents[j];
+            }
+        }
+    }
+    if (tail != n) {
+        PyErr_SetString(PyExc_ValueError, "dependency graph has a cycle");
+        goto done;
+    }
+    result = 0;
+done:
+    Py_XDECREF(index);
+    Py_XDECREF(edges);
+    PyMem_Free(fill);
+    PyMem_Free(indegree);
+    return result;
+}
+
+static PyStructSequence_Field spam_job_result_fields[] = {
+        {"status", "exit status like system(), or None if skipped because a dependency failed"},
+        {"start",  "start time in seconds since the graph started, or None"},
+        {"end",    "end time in seconds since the graph started, or None"},
+        {NULL}
+};
+
+static PyStructSequence_Desc spam_job_result_desc = {
+        "spam.job_result",
+        "Outcome of one job run by spam.run_graph().",
+        spam_job_result_fields,
+        3,
+};
+
+static PyStructSequence_Field spam_graph_result_fields[] = {
+        {"results",            "dict mapping job name to spam.job_result"},
+        {"critical_path",      "job names on the longest chain of dependent jobs that ran"},
+        {"critical_path_time", "summed run time of the critical path in seconds"},
+        {"wall_time",          "elapsed time of the whole graph in seconds"},
+        {NULL}
+};
+
+static PyStructSequence_Desc spam_graph_result_desc = {
+        "spam.graph_result",
+        "Per-job timings and critical path statistics from spam.run_graph().",
+        spam_graph_result_fields,
+        4,
+};
+
+static PyTypeObject SpamJobResultType;
+static PyTypeObject SpamGraphResultType;
+
+static PyObject *
+spam_job_result_new(SpamJob *job, double origin) {
+    PyObject *result = PyStructSequence_New(&SpamJobResultType);
+
+    if (result == NULL) {
+        return NULL;
+    }
+    if (job->start == 0.0) {
+        Py_INCREF(Py_None);
+        PyStructSequence_SET_ITEM(result, 0, Py_None);
+        Py_INCREF(Py_None);
+        PyStructSequence_SET_ITEM(result, 1, Py_None);
+        Py_INCREF(Py_None);
+        PyStructSequence_SET_ITEM(result, 2, Py_None);
+        return result;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyLong_FromLong(job->status));
+    PyStructSequence_SET_ITEM(result, 1, PyFloat_FromDouble(job->start - origin));
+    PyStructSequence_SET_ITEM(result, 2, PyFloat_FromDouble(job->end - origin));
+    if (PyErr_Occurred()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+spam_run_graph(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"jobs", "deps", "max_parallel", NULL};
+    PyObject *jobs, *deps = Py_None, *names = NULL, *commands = NULL, *results = NULL;
+    PyObject *path = NULL, *item, *result = NULL;
+    Py_ssize_t max_parallel = 0, n, i, last = -1;
+    Py_ssize_t *prev = NULL;
+    double *finish = NULL, origin, wall_time, critical = 0.0;
+    SpamRunner runner;
+    SpamGraph graph;
+
+    memset(&runner, 0, sizeof(runner));
+    memset(&graph, 0, sizeof(graph));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|On", kwlist, &jobs, &deps, &max_parallel)) {
+        return NULL;
+    }
+    if (!PyDict_Check(jobs)) {
+        PyErr_SetString(PyExc_TypeError, "jobs must be a dict mapping names to commands");
+        return NULL;
+    }
+    names = PyDict_Keys(jobs);
+    commands = PyDict_Values(jobs);
+    if (names == NULL || commands == NULL) {
+        goto done;
+    }
+    n = PyList_GET_SIZE(names);
+    if (spam_graph_init(&graph, names, deps) < 0) {
+        goto done;
+    }
+    if (spam_runner_init(&runner, commands, max_parallel, 0) < 0) {
+        goto done;
+    }
+    // 依存先のないジョブだけを最初に積む
+    runner.nready = 0;
+    for (i = 0; i < n; i++) {
+        if (graph.indegree[i] == 0) {
+            runner.ready[runner.nready++] = i;
+        }
+    }
+    runner.on_finished = spam_graph_on_finished;
+    runner.context = &graph;
+    origin = spam_monotonic();
+    if (spam_runner_run(&runner) < 0) {
+        goto done;
+    }
+    wall_time = spam_monotonic() - origin;
+
+    // 実際の所要時間で最長経路 (クリティカルパス) を求める
+    finish = PyMem_Calloc(n + 1, sizeof(double));
+    prev = PyMem_Calloc(n + 1, sizeof(Py_ssize_t));
+    if (finish == NULL || prev == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        prev[i] = -1;
+    }
+    for (Py_ssize_t k = 0; k < n; k++) {
+        Py_ssize_t u = graph.order[k];
+        SpamJob *job = &runner.jobs[u];
+        if (job->start == 0.0) {
+            continue;
+        }
+        finish[u] += job->end - job->start;
+        if (finish[u] > critical) {
+            critical = finish[u];
+            last = u;
+        }
+        for (Py_ssize_t e = graph.edge_start[u]; e < graph.edge_start[u + 1]; e++) {
+            Py_ssize_t v = graph.dependents[e];
+            if (finish[u] > finish[v]) {
+                finish[v] = finish[u];
+                prev[v] = u;
+            }
+        }
+    }
+
+    results = PyDict_New();
+    path = PyList_New(0);
+    if (results == NULL || path == NULL) {
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        item = spam_job_result_new(&runner.jobs[i], origin);
+        if (item == NULL || PyDict_SetItem(results, PyList_GET_ITEM(names, i), item) < 0) {
+            Py_XDECREF(item);
+            goto done;
+        }
+        Py_DECREF(item);
+    }
+    for (i = last; i >= 0; i = prev[i]) {
+        if (PyList_Insert(path, 0, PyList_GET_ITEM(names, i)) < 0) {
+            goto done;
+        }
+    }
+    result = PyStructSequence_New(&SpamGraphResultType);
+    if (result == NULL) {
+        goto done;
+    }
+    PyStructSequence_SET_ITEM(result, 0, results);
+    PyStructSequence_SET_ITEM(result, 1, path);
+    results = path = NULL;
+    PyStructSequence_SET_ITEM(result, 2, PyFloat_FromDouble(critical));
+    PyStructSequence_SET_ITEM(result, 3, PyFloat_FromDouble(wall_time));
+    if (PyErr_Occurred()) {
+        Py_CLEAR(result);
+    }
+done:
+    spam_runner_free(&runner);
+    spam_graph_free(&graph);
+    PyMem_Free(finish);
+    PyMem_Free(prev);
+    Py_XDECREF(names);
+    Py_XDECREF(commands);
+    Py_XDECREF(results);
+    Py_XDECREF(path);
+    return result;
+}
+
+// ---- タイムアウトとキャンセル ----
+// 子の pidfd (出力を読む間はパイプ)、timerfd、キャンセル用 eventfd を 1 回の poll() で待つ
+// 期限切れやキャンセル時はプロセスグループごと SIGKILL するので、子は新しいグループで起動しておく
+
+#define SPAM_FINISHED 0
+#define SPAM_TIMED_OUT 1
+#define SPAM_CANCELLED 2
+
+static PyObject *SpamTimeoutExpired;
+static PyObject *SpamCancelled;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int fd;            // eventfd。書き込まれたら読み出すまで readable のままになる
+} CancellerObject;
+
+static void
+Canceller_dealloc(CancellerObject *self) {
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+Canceller_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {NULL};
+    CancellerObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+        return NULL;
+    }
+    self = (CancellerObject *) type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (self->fd < 0) {
+        Py_DECREF(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return (PyObject *) self;
+}
+
+static PyObject *
+Canceller_cancel(CancellerObject *self, PyObject *Py_UNUSED(ignored)) {
+    // どのスレッドからでも呼べる。待っている全コマンドが起きる
+    if (eventfd_write(self->fd, 1) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Canceller_reset(CancellerObject *self, PyObject *Py_UNUSED(ignored)) {
+    eventfd_t value;
+
+    if (eventfd_read(self->fd, &value) < 0 && errno != EAGAIN) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Canceller_getcancelled(CancellerObject *self, void *closure) {
+    struct pollfd pfd = {self->fd, POLLIN, 0};
+
+    return PyBool_FromLong(poll(&pfd, 1, 0) > 0);
+}
+
+static PyObject *
+Canceller_fileno(CancellerObject *self, PyObject *Py_UNUSED(ignored)) {
+    return PyLong_FromLong(self->fd);
+}
+
+static PyMethodDef Canceller_methods[] = {
+        {"cancel", (PyCFunction) Canceller_cancel, METH_NOARGS,
+                "Kill every command waiting on this canceller, now and until reset()."},
+        {"reset",  (PyCFunction) Canceller_reset,  METH_NOARGS, "Clear the cancelled state."},
+        {"fileno", (PyCFunction) Canceller_fileno, METH_NOARGS, "Return the underlying eventfd."},
+        {NULL}
+};
+
+static PyGetSetDef Canceller_getsetters[] = {
+        {"cancelled", (getter) Canceller_getcancelled, NULL, "whether cancel() was called since the last reset()", NULL},
+        {NULL}
+};
+
+static PyTypeObject CancellerType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "spam.Canceller",
+        .tp_doc = "Canceller()\n"
+                  "Token passed as cancel= to spam.system() or spam.check_output() to kill them from another thread.",
+        .tp_basicsize = sizeof(CancellerObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_new = Canceller_new,
+        .tp_dealloc = (destructor) Canceller_dealloc,
+        .tp_methods = Canceller_methods,
+        .tp_getset = Canceller_getsetters,
+};
+
+// cancel 引数を eventfd に変換する。None なら -1
+static int
+spam_cancel_fd(PyObject *cancel, int *fd) {
+    if (cancel == NULL || cancel == Py_None) {
+        *fd = -1;
+        return 0;
+    }
+    if (!PyObject_TypeCheck(cancel, &CancellerType)) {
+        PyErr_SetString(PyExc_TypeError, "cancel must be a spam.Canceller");
+        return -1;
+    }
+    *fd = ((CancellerObject *) cancel)->fd;
+    return 0;
+}
+
+// pid (プロセスグループのリーダー) の終了を待つ。out_fd が 0 以上ならその EOF まで *output へ読み込む
+// timeout が負なら期限なし。GIL を解放したまま呼び、終わったら子は必ず回収済みになっている
+// 戻り値は SPAM_FINISHED / SPAM_TIMED_OUT / SPAM_CANCELLED、例外をセットした場合は -1
+static int
+spam_supervise(pid_t pid, int out_fd, PyObject **output, Py_ssize_t *len, double timeout, int cancel_fd,
+               double start, int *status, PyThreadState **tstate) {
+    struct pollfd fds[3];
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    int pidfd, timerfd = -1, result = SPAM_FINISHED, err = 0;
+    Py_ssize_t n;
+
+    pidfd = spam_pidfd_open(pid);
+    if (pidfd < 0) {
+        err = errno;
+        goto kill;
+    }
+    if (timeout >= 0) {
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timerfd < 0) {
+            err = errno;
+            goto kill;
+        }
+        its.it_value.tv_sec = (time_t) timeout;
+        its.it_value.tv_nsec = (long) ((timeout - (double) its.it_value.tv_sec) * 1e9);
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            // 0 を設定するとタイマーが止まってしまうので、すぐに満了させる
+            its.it_value.tv_nsec = 1;
+        }
+        if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+            err = errno;
+            goto kill;
+        }
+    }
+    for (;;) {
+        fds[0].fd = out_fd >= 0 ? out_fd : pidfd;
+        fds[1].fd = timerfd;
+        fds[2].fd = cancel_fd;
+        fds[0].events = fds[1].events = fds[2].events = POLLIN;
+        fds[0].revents = fds[1].revents = fds[2].revents = 0;
+        if (poll(fds, 3, -1) < 0) {
+            if (errno != EINTR) {
+                err = errno;
+                goto kill;
+            }
+            PyEval_RestoreThread(*tstate);
+            n = PyErr_CheckSignals();
+            *tstate = PyEval_SaveThread();
+            if (n < 0) {
+                result = -1;
+                goto kill;
+            }
+            continue;
+        }
+        if (fds[2].revents) {
+            result = SPAM_CANCELLED;
+            goto kill;
+        }
+        if (fds[1].revents) {
+            result = SPAM_TIMED_OUT;
+            goto kill;
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+        if (out_fd < 0) {
+            break;
+        }
+        n = spam_read_into(out_fd, output, len, tstate);
+        if (n < 0) {
+            result = -1;
+            goto kill;
+        }
+        if (n == 0) {
+            // EOF 以降は pidfd で終了を待つ
+            out_fd = -1;
+        }
+    }
+    goto reap;
+kill:
+    kill(-pid, SIGKILL);
+reap:
+    spam_wait(pid, status, 0, start, NULL);
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    if (timerfd >= 0) {
+        close(timerfd);
+    }
+    if (err != 0) {
+        PyEval_RestoreThread(*tstate);
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        *tstate = PyEval_SaveThread();
+        return -1;
+    }
+    return result;
+}
+
+// spam_supervise() の結果に応じて例外をセットする。SPAM_FINISHED なら 0
+static int
+spam_supervise_error(int result, double timeout, PyObject *output) {
+    if (result == SPAM_TIMED_OUT) {
+        PyErr_SetObject(SpamTimeoutExpired, Py_BuildValue("(sdO)", "command timed out", timeout,
+                                                          output == NULL ? Py_None : output));
+        return -1;
+    }
+    if (result == SPAM_CANCELLED) {
+        PyErr_SetObject(SpamCancelled, Py_BuildValue("(sO)", "command cancelled",
+                                                     output == NULL ? Py_None : output));
+        return -1;
+    }
+    return result < 0 ? -1 : 0;
+}
+
+static PyObject *
+spam_system_supervised(const char *command, double timeout, PyObject *cancel) {
+    char *argv[] = {"/bin/sh", "-c", (char *) command, NULL};
+    PyThreadState *tstate;
+    int cancel_fd, err, status = 0, result = SPAM_FINISHED;
+    double start;
+    pid_t pid;
+
+    if (spam_cancel_fd(cancel, &cancel_fd) < 0) {
+        return NULL;
+    }
+    tstate = PyEval_SaveThread();
+    start = spam_monotonic();
+    err = spam_spawn(argv, -1, -1, -1, 1, &pid);
+    if (err == 0) {
+        result = spam_supervise(pid, -1, NULL, NULL, timeout, cancel_fd, start, &status, &tstate);
+    }
+    PyEval_RestoreThread(tstate);
+    if (err != 0) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (spam_supervise_error(result, timeout, NULL) < 0) {
+        return NULL;
+    }
+    return PyLong_FromLong(status);
+}
+
+// argv を実行して stdout (merge_stderr なら stderr も) を bytes で返す。status には終了ステータスが入る
+// timeout (負なら期限なし) か cancel_fd (なければ -1) を指定すると spam_supervise() で監視する
+static PyObject *
+spam_capture(char **argv, int merge_stderr, double timeout, int cancel_fd, int *status) {
+    PyObject *output = NULL, *result;
+    PyThreadState *tstate;
+    Py_ssize_t len = 0, n;
+    int pipefd[2], err, supervised = timeout >= 0 || cancel_fd >= 0, outcome = SPAM_FINISHED;
+    double start;
+    pid_t pid;
+
+    *status = 0;
+    if (spam_capture_pipe(pipefd) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    tstate = PyEval_SaveThread();
+    start = spam_monotonic();
+    err = spam_spawn(argv, -1, pipefd[1], merge_stderr ? pipefd[1] : -1, supervised, &pid);
+    close(pipefd[1]);
+    if (err == 0 && supervised) {
+        outcome = spam_supervise(pid, pipefd[0], &output, &len, timeout, cancel_fd, start, status, &tstate);
+    } else if (err == 0) {
+        while ((n = spam_read_into(pipefd[0], &output, &len, &tstate)) > 0) {
+        }
+        if (n < 0) {
+            // bytes を伸ばせなかったので子を止めてから例外を返す
+            kill(pid, SIGKILL);
+        }
+        spam_wait(pid, status, 0, start, NULL);
+    }
+    close(pipefd[0]);
+    PyEval_RestoreThread(tstate);
+
+    if (err != 0) {
+        errno = err;
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, argv[0]);
+    }
+    if (PyErr_Occurred()) {
+        Py_XDECREF(output);
+        return NULL;
+    }
+    result = spam_take_output(&output, len);
+    if (result != NULL && spam_supervise_error(outcome, timeout, result) < 0) {
+        // 期限切れまでに読めた出力は例外の引数に入れる
+        Py_CLEAR(result);
+    }
+    return result;
+}
+
+static PyObject *
+spam_check_output(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"argv", "stderr", "timeout", "cancel", NULL};
+    PyObject *command, *result, *cancel = Py_None;
+    char **argv;
+    double timeout = -1.0;
+    int merge_stderr = 0, status, cancel_fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|pO&O", kwlist, &command, &merge_stderr,
+                                     spam_timeout_converter, &timeout, &cancel)) {
+        return NULL;
+    }
+    if (spam_cancel_fd(cancel, &cancel_fd) < 0) {
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    result = spam_capture(argv, merge_stderr, timeout, cancel_fd, &status);
+    spam_argv_free(argv);
+    if (result == NULL) {
+        return NULL;
+    }
+    if (status != 0) {
+        // 失敗時もそれまでの出力は捨てずに例外の引数に入れる
+        PyErr_SetObject(SpamError, Py_BuildValue("(siN)", "command failed", status, result));
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+spam_pipeline(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"stages", "capture", NULL};
+    PyObject *stages, *seq, *statuses = NULL, *output = NULL, *result = NULL;
+    PyThreadState *tstate;
+    Py_ssize_t nstages, i, spawned = 0, out_len = 0, n = 0;
+    char ***argvs;
+    pid_t *pids;
+    int *status;
+    int capture = 0, err = 0, in_fd = -1, pipefd[2], out_fd = -1;
+    double start;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", kwlist, &stages, &capture)) {
+        return NULL;
+    }
+    seq = PySequence_Fast(stages, "stages must be a sequence of commands");
+    if (seq == NULL) {
+        return NULL;
+    }
+    nstages = PySequence_Fast_GET_SIZE(seq);
+    if (nstages == 0) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "pipeline needs at least one stage");
+        return NULL;
+    }
+    argvs = PyMem_Calloc(nstages, sizeof(char **));
+    pids = PyMem_Calloc(nstages, sizeof(pid_t));
+    status = PyMem_Calloc(nstages, sizeof(int));
+    if (argvs == NULL || pids == NULL || status == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < nstages; i++) {
+        argvs[i] = spam_argv_from_object(PySequence_Fast_GET_ITEM(seq, i));
+        if (argvs[i] == NULL) {
+            goto done;
+        }
+    }
+
+    // 前段の読み込み側を次段の stdin にしながら順に起動する。親の手元に残す fd は常に最小限にする
+    tstate = PyEval_SaveThread();
+    start = spam_monotonic();
+    for (i = 0; i < nstages && err == 0; i++) {
+        int last = i == nstages - 1;
+        pipefd[0] = pipefd[1] = -1;
+        if (!last) {
+            if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                err = errno;
+                break;
+            }
+        } else if (capture) {
+            if (spam_capture_pipe(pipefd) < 0) {
+                err = errno;
+                break;
+            }
+        }
+        err = spam_spawn(argvs[i], in_fd, pipefd[1], -1, 0, &pids[i]);
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (pipefd[1] >= 0) {
+            close(pipefd[1]);
+        }
+        in_fd = last ? -1 : pipefd[0];
+        if (last) {
+            out_fd = pipefd[0];
+        }
+        if (err == 0) {
+            spawned++;
+        }
+    }
+    // 途中で失敗した場合も起動済みの段は入力の EOF か SIGPIPE で終わるので、すべて回収する
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        if (err == 0) {
+            while ((n = spam_read_into(out_fd, &output, &out_len, &tstate)) > 0) {
+            }
+        }
+        close(out_fd);
+    }
+    for (i = 0; i < spawned; i++) {
+        if (n < 0) {
+            kill(pids[i], SIGKILL);
+        }
+        spam_wait(pids[i], &status[i], 0, start, NULL);
+    }
+    PyEval_RestoreThread(tstate);
+
+    if (n < 0) {
+        goto done;
+    }
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, spawned < nstages ? argvs[spawned][0] : NULL);
+        goto done;
+    }
+    statuses = PyList_New(nstages);
+    if (statuses == NULL) {
+        goto done;
+    }
+    for (i = 0; i < nstages; i++) {
+        PyObject *item = PyLong_FromLong(status[i]);
+        if (item == NULL) {
+            goto done;
+        }
+        PyList_SET_ITEM(statuses, i, item);
+    }
+    if (capture) {
+        PyObject *data = spam_take_output(&output, out_len);
+        if (data == NULL) {
+            goto done;
+        }
+        result = Py_BuildValue("(ON)", statuses, data);
+    } else {
+        result = statuses;
+        Py_INCREF(result);
+    }
+done:
+    Py_XDECREF(statuses);
+    Py_XDECREF(output);
+    if (argvs != NULL) {
+        for (i = 0; i < nstages; i++) {
+            spam_argv_free(argvs[i]);
+        }
+    }
+    PyMem_Free(argvs);
+    PyMem_Free(pids);
+    PyMem_Free(status);
+    Py_DECREF(seq);
+    return result;
+}
+
+// ---- run_rusage ----
+
+static PyStructSequence_Field spam_rusage_fields[] = {
+        {"status",               "exit status like system()"},
+        {"wall_time",            "elapsed wall clock time in seconds"},
+        {"user_time",            "user CPU time in seconds"},
+        {"system_time",          "system CPU time in seconds"},
+        {"max_rss",              "maximum resident set size in KiB"},
+        {"minor_faults",         "page faults serviced without I/O"},
+        {"major_faults",         "page faults that required I/O"},
+        {"voluntary_switches",   "voluntary context switches"},
+        {"involuntary_switches", "involuntary context switches"},
+        {NULL}
+};
+
+static PyStructSequence_Desc spam_rusage_desc = {
+        "spam.rusage_result",
+        "Exit status and resource usage of a command run by spam.run_rusage().",
+        spam_rusage_fields,
+        9,
+};
+
+static PyStructSequence_Field spam_totals_fields[] = {
+        {"commands",             "number of children reaped"},
+        {"wall_time",            "summed wall clock time in seconds"},
+        {"user_time",            "summed user CPU time in seconds"},
+        {"system_time",          "summed system CPU time in seconds"},
+        {"max_rss",              "largest maximum resident set size in KiB"},
+        {"minor_faults",         "summed minor page faults"},
+        {"major_faults",         "summed major page faults"},
+        {"voluntary_switches",   "summed voluntary context switches"},
+        {"involuntary_switches", "summed involuntary context switches"},
+        {NULL}
+};
+
+static PyStructSequence_Desc spam_totals_desc = {
+        "spam.rusage_totals_result",
+        "Resource usage summed over every child reaped by spam.",
+        spam_totals_fields,
+        9,
+};
+
+static PyTypeObject SpamRusageType;
+static PyTypeObject SpamTotalsType;
+
+static PyObject *
+spam_run_rusage(PyObject *self, PyObject *args) {
+    PyObject *command, *result;
+    struct rusage ru = {0};
+    char **argv;
+    double start, wall_time = 0.0;
+    int err, status = 0;
+    pid_t pid;
+
+    if (!PyArg_ParseTuple(args, "O", &command)) {
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    start = spam_monotonic();
+    err = spam_spawn(argv, -1, -1, -1, 0, &pid);
+    if (err == 0) {
+        spam_wait(pid, &status, 0, start, &ru);
+        wall_time = spam_monotonic() - start;
+    }
+    Py_END_ALLOW_THREADS
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, argv[0]);
+        spam_argv_free(argv);
+        return NULL;
+    }
+    spam_argv_free(argv);
+
+    result = PyStructSequence_New(&SpamRusageType);
+    if (result == NULL) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyLong_FromLong(status));
+    PyStructSequence_SET_ITEM(result, 1, PyFloat_FromDouble(wall_time));
+    PyStructSequence_SET_ITEM(result, 2, PyFloat_FromDouble(spam_timeval_seconds(ru.ru_utime)));
+    PyStructSequence_SET_ITEM(result, 3, PyFloat_FromDouble(spam_timeval_seconds(ru.ru_stime)));
+    PyStructSequence_SET_ITEM(result, 4, PyLong_FromLong(ru.ru_maxrss));
+    PyStructSequence_SET_ITEM(result, 5, PyLong_FromLong(ru.ru_minflt));
+    PyStructSequence_SET_ITEM(result, 6, PyLong_FromLong(ru.ru_majflt));
+    PyStructSequence_SET_ITEM(result, 7, PyLong_FromLong(ru.ru_nvcsw));
+    PyStructSequence_SET_ITEM(result, 8, PyLong_FromLong(ru.ru_nivcsw));
+    if (PyErr_Occurred()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+spam_rusage_totals(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *result;
+    SpamUsage totals;
+
+    pthread_mutex_lock(&spam_usage_lock);
+    totals = spam_usage_totals;
+    pthread_mutex_unlock(&spam_usage_lock);
+
+    result = PyStructSequence_New(&SpamTotalsType);
+    if (result == NULL) {
+        return NULL;
+    }
+    PyStructSequence_SET_ITEM(result, 0, PyLong_FromLongLong(totals.commands));
+    PyStructSequence_SET_ITEM(result, 1, PyFloat_FromDouble(totals.wall_time));
+    PyStructSequence_SET_ITEM(result, 2, PyFloat_FromDouble(totals.user_time));
+    PyStructSequence_SET_ITEM(result, 3, PyFloat_FromDouble(totals.system_time));
+    PyStructSequence_SET_ITEM(result, 4, PyLong_FromLong(totals.max_rss));
+    PyStructSequence_SET_ITEM(result, 5, PyLong_FromLongLong(totals.minor_faults));
+    PyStructSequence_SET_ITEM(result, 6, PyLong_FromLongLong(totals.major_faults));
+    PyStructSequence_SET_ITEM(result, 7, PyLong_FromLongLong(totals.voluntary_switches));
+    PyStructSequence_SET_ITEM(result, 8, PyLong_FromLongLong(totals.involuntary_switches));
+    if (PyErr_Occurred()) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+spam_reset_rusage_totals(PyObject *self, PyObject *Py_UNUSED(ignored)) {
+    pthread_mutex_lock(&spam_usage_lock);
+    memset(&spam_usage_totals, 0, sizeof(spam_usage_totals));
+    pthread_mutex_unlock(&spam_usage_lock);
+    Py_RETURN_NONE;
+}
+
+// ---- LineIterator (iter_lines) ----
+// 子の stdout を固定サイズのリングバッファに読み込み、行ごとに bytes で返す
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    pid_t pid;         // 回収したら 0
+    int fd;            // 読み込み側パイプ。EOF を読んだら -1
+    int status;
+    int exited;
+    double start;
+    char *buf;         // リングバッファ
+    Py_ssize_t size;
+    Py_ssize_t head;   // 未消費データの先頭位置
+    Py_ssize_t count;  // 未消費データ量
+    Py_ssize_t scanned;  // head から改行がないと確認済みの長さ
+    int running;         // next() の途中。GIL を手放して read() している間に他スレッドが触らないようにする
+    int close_requested; // next() の途中で close() された
+} LineIteratorObject;
+
+static void
+LineIterator_finish(LineIteratorObject *self, int sig) {
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    if (self->pid != 0) {
+        // GIL を手放す前に pid を消しておく。別スレッドの close() や next() が同じ pid を
+        // もう一度 wait すると、回収後に再利用された無関係な子を刈り取ってしまう
+        pid_t pid = self->pid;
+        int status = 0;
+
+        self->pid = 0;
+        if (sig != 0) {
+            kill(pid, sig);
+        }
+        Py_BEGIN_ALLOW_THREADS
+        spam_wait(pid, &status, 0, self->start, NULL);
+        Py_END_ALLOW_THREADS
+        self->status = status;
+        self->exited = 1;
+    }
+}
+
+static void
+LineIterator_dealloc(LineIteratorObject *self) {
+    // 読み切られていなければ子を止める。パイプを閉じるだけだと SIGPIPE を無視する子で待ち続けてしまう
+    LineIterator_finish(self, SIGKILL);
+    PyMem_Free(self->buf);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// head から len バイトを bytes にして消費する。リングの終端をまたぐ場合は 2 回に分けてコピーする
+static PyObject *
+LineIterator_take(LineIteratorObject *self, Py_ssize_t len) {
+    PyObject *line = PyBytes_FromStringAndSize(NULL, len);
+    Py_ssize_t first;
+
+    if (line == NULL) {
+        return NULL;
+    }
+    first = self->size - self->head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(PyBytes_AS_STRING(line), self->buf + self->head, first);
+    memcpy(PyBytes_AS_STRING(line) + first, self->buf, len - first);
+    self->head = (self->head + len) % self->size;
+    self->count -= len;
+    self->scanned = 0;
+    return line;
+}
+
+// 未確認部分から改行を探し、見つかれば行の長さ (改行を含む) を返す。なければ 0
+static Py_ssize_t
+LineIterator_find(LineIteratorObject *self) {
+    while (self->scanned < self->count) {
+        Py_ssize_t pos = (self->head + self->scanned) % self->size;
+        Py_ssize_t avail = self->count - self->scanned;
+        char *nl;
+
+        if (avail > self->size - pos) {
+            avail = self->size - pos;
+        }
+        nl = memchr(self->buf + pos, '\n', avail);
+        if (nl != NULL) {
+            return self->scanned + (nl - (self->buf + pos)) + 1;
+        }
+        self->scanned += avail;
+    }
+    return 0;
+}
+
+static PyObject *
+LineIterator_read_line(LineIteratorObject *self) {
+    Py_ssize_t len, tail, space;
+    ssize_t n;
+
+    for (;;) {
+        len = LineIterator_find(self);
+        if (len > 0) {
+            return LineIterator_take(self, len);
+        }
+        if (self->count == self->size) {
+            // バッファより長い行は bufsize ごとに区切って返す
+            return LineIterator_take(self, self->count);
+        }
+        if (self->fd < 0) {
+            if (self->count > 0) {
+                return LineIterator_take(self, self->count);
+            }
+            LineIterator_finish(self, 0);
+            return NULL;
+        }
+        // 末尾の空き領域のうち連続している部分に読み込む
+        tail = (self->head + self->count) % self->size;
+        space = tail >= self->head ? self->size - tail : self->head - tail;
+        if (self->count == 0) {
+            self->head = tail = 0;
+            space = self->size;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        do {
+            n = read(self->fd, self->buf + tail, space);
+        } while (n < 0 && errno == EINTR);
+        Py_END_ALLOW_THREADS
+        // 読んでいる間に close() されていたら、読めた分も捨てて終わる
+        if (self->close_requested) {
+            LineIterator_finish(self, SIGKILL);
+            return NULL;
+        }
+        if (n < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            LineIterator_finish(self, SIGKILL);
+            return NULL;
+        }
+        if (n == 0) {
+            close(self->fd);
+            self->fd = -1;
+        }
+        self->count += n;
+    }
+}
+
+// ジェネレータと同じく、実行中の next() に別スレッドから入ることは許さない
+static PyObject *
+LineIterator_next(LineIteratorObject *self) {
+    PyObject *line;
+
+    if (self->running) {
+        PyErr_SetString(PyExc_ValueError, "iterator already executing");
+        return NULL;
+    }
+    self->running = 1;
+    line = LineIterator_read_line(self);
+    self->running = 0;
+    return line;
+}
+
+static PyObject *
+LineIterator_close(LineIteratorObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (self->running) {
+        // 読んでいる最中の fd を閉じると、番号が再利用されて無関係なファイルを読みかねない
+        // 子を止めて read() を返させ、後始末は next() を実行しているスレッドに任せる
+        // fd が閉じていれば子を回収している最中なので、pid はもう使わない
+        self->close_requested = 1;
+        if (self->fd >= 0 && self->pid != 0) {
+            kill(self->pid, SIGKILL);
+        }
+        Py_RETURN_NONE;
+    }
+    LineIterator_finish(self, self->fd >= 0 ? SIGKILL : 0);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LineIterator_getreturncode(LineIteratorObject *self, void *closure) {
+    if (!self->exited) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(self->status);
+}
+
+static PyMethodDef LineIterator_methods[] = {
+        {"close", (PyCFunction) LineIterator_close, METH_NOARGS,
+                "Kill the child if it is still writing and reap it.\n"
+                "If another thread is inside next(), the child is killed now and that thread reaps it."},
+        {NULL}
+};
+
+static PyMemberDef LineIterator_members[] = {
+        {"pid", T_INT, offsetof(LineIteratorObject, pid), READONLY, "process id, or 0 once reaped"},
+        {NULL},
+};
+
+static PyGetSetDef LineIterator_getsetters[] = {
+        {"returncode", (getter) LineIterator_getreturncode, NULL,
+                "exit status like system() once the output is exhausted, otherwise None", NULL},
+        {NULL}
+};
+
+static PyTypeObject LineIteratorType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "spam.LineIterator",
+        .tp_doc = "Iterator over the stdout lines of a child started by spam.iter_lines().",
+        .tp_basicsize = sizeof(LineIteratorObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_dealloc = (destructor) LineIterator_dealloc,
+        .tp_iter = PyObject_SelfIter,
+        .tp_iternext = (iternextfunc) LineIterator_next,
+        .tp_methods = LineIterator_methods,
+        .tp_members = LineIterator_members,
+        .tp_getset = LineIterator_getsetters,
+};
+
+static PyObject *
+spam_iter_lines(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"argv", "bufsize", NULL};
+    PyObject *command;
+    LineIteratorObject *it;
+    Py_ssize_t bufsize = SPAM_READ_CHUNK;
+    char **argv;
+    int pipefd[2], err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &command, &bufsize)) {
+        return NULL;
+    }
+    if (bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    it = PyObject_New(LineIteratorObject, &LineIteratorType);
+    if (it == NULL) {
+        spam_argv_free(argv);
+        return NULL;
+    }
+    it->pid = 0;
+    it->fd = -1;
+    it->status = 0;
+    it->exited = 0;
+    it->head = it->count = it->scanned = 0;
+    it->running = 0;
+    it->close_requested = 0;
+    it->size = bufsize;
+    it->buf = PyMem_Malloc(bufsize);
+    if (it->buf == NULL) {
+        spam_argv_free(argv);
+        Py_DECREF(it);
+        return PyErr_NoMemory();
+    }
+    if (spam_capture_pipe(pipefd) < 0) {
+        spam_argv_free(argv);
+        Py_DECREF(it);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    it->start = spam_monotonic();
+    err = spam_spawn(argv, -1, pipefd[1], -1, 0, &it->pid);
+    close(pipefd[1]);
+    if (err != 0) {
+        close(pipefd[0]);
+        it->pid = 0;
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, argv[0]);
+        spam_argv_free(argv);
+        Py_DECREF(it);
+        return NULL;
+    }
+    spam_argv_free(argv);
+    it->fd = pipefd[0];
+    return (PyObject *) it;
+}
+
+// ---- Cache ----
+// 入力ファイルの (inode, サイズ, mtime) と argv をキーに、終了ステータスと出力をディスクに保存する
+// 1 エントリ 1 ファイルで、ファイル名はキーの 64bit FNV-1a ハッシュ。衝突はキー本体の比較で検出する
+
+#define SPAM_CACHE_MAGIC "SPAMC001"
+// 上限を超えたらここまで追い出す。上限ちょうどで止めると、満杯の間はミスのたびにディレクトリ全体を走査することになる
+#define SPAM_CACHE_LOW_WATER(max_bytes) ((max_bytes) / 10 * 9)
+
+typedef struct {
+    char magic[8];
+    int32_t status;
+    uint32_t key_len;
+    uint64_t output_len;
+} SpamCacheHeader;
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    PyObject *directory;  // str
+    long long max_bytes;
+    long long size;       // このオブジェクトが把握しているエントリの合計サイズ
+    long long hits;
+    long long misses;
+    long long evictions;
+} CacheObject;
+
+static uint64_t
+spam_fnv1a(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// キー本体を組み立てる。argv を NUL 区切りで並べ、続けて入力ファイルごとにパスと stat の情報を並べる
+// inputs が NULL なら argv だけがキーになる
+static PyObject *
+spam_cache_key(char **argv, PyObject *inputs) {
+    PyObject *key, *seq, *path, *part;
+    struct stat st;
+    char stamp[128];
+    int r;
+
+    key = PyBytes_FromStringAndSize(NULL, 0);
+    if (key == NULL) {
+        return NULL;
+    }
+    for (char **p = argv; *p != NULL; p++) {
+        PyBytes_ConcatAndDel(&key, PyBytes_FromStringAndSize(*p, strlen(*p) + 1));
+        if (key == NULL) {
+            return NULL;
+        }
+    }
+    if (inputs == NULL) {
+        return key;
+    }
+    seq = PySequence_Fast(inputs, "inputs must be a sequence of paths");
+    if (seq == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, i), &path)) {
+            goto error;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        r = stat(PyBytes_AS_STRING(path), &st);
+        Py_END_ALLOW_THREADS
+        if (r < 0) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path));
+            Py_DECREF(path);
+            goto error;
+        }
+        // PyBytes_FromFormat は long long や桁指定を扱えないので先に文字列にする
+        snprintf(stamp, sizeof(stamp), "%llu:%llu:%lld:%lld.%09ld",
+                 (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+                 (long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        part = PyBytes_FromFormat("\x1f%s\x1f%s", PyBytes_AS_STRING(path), stamp);
+        Py_DECREF(path);
+        PyBytes_ConcatAndDel(&key, part);
+        if (key == NULL) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return key;
+error:
+    Py_DECREF(seq);
+    Py_DECREF(key);
+    return NULL;
+}
+
+static PyObject *
+spam_cache_entry_path(CacheObject *self, PyObject *key, const char *suffix) {
+    uint64_t h = spam_fnv1a(PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+    PyObject *path, *encoded;
+    char name[17];
+
+    // PyUnicode_FromFormat は桁指定付きの %llx を扱えないので先に文字列にする
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) h);
+    path = PyUnicode_FromFormat("%U/%s%s", self->directory, name, suffix);
+    if (path == NULL) {
+        return NULL;
+    }
+    if (!PyUnicode_FSConverter(path, &encoded)) {
+        encoded = NULL;
+    }
+    Py_DECREF(path);
+    return encoded;
+}
+
+static int
+spam_read_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+spam_write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// ヒットすれば (status, output) を、ミスなら None を返す。読めないエントリはミス扱いにする
+static PyObject *
+spam_cache_lookup(PyObject *path, PyObject *key) {
+    SpamCacheHeader header;
+    PyObject *output = NULL, *stored_key;
+    Py_ssize_t key_len = PyBytes_GET_SIZE(key);
+    int fd, ok = 0;
+
+    fd = open(PyBytes_AS_STRING(path), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        Py_RETURN_NONE;
+    }
+    stored_key = PyBytes_FromStringAndSize(NULL, key_len);
+    if (stored_key == NULL) {
+        close(fd);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (spam_read_full(fd, (char *) &header, sizeof(header)) == 0
+        && memcmp(header.magic, SPAM_CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.key_len == (uint64_t) key_len
+        && spam_read_full(fd, PyBytes_AS_STRING(stored_key), key_len) == 0
+        && memcmp(PyBytes_AS_STRING(stored_key), PyBytes_AS_STRING(key), key_len) == 0) {
+        ok = 1;
+    }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(stored_key);
+    if (ok && header.output_len <= PY_SSIZE_T_MAX) {
+        output = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) header.output_len);
+        if (output == NULL) {
+            close(fd);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        ok = spam_read_full(fd, PyBytes_AS_STRING(output), header.output_len) == 0;
+        // mtime を最終利用時刻として LRU の追い出しに使う
+        if (ok) {
+            futimens(fd, NULL);
+        }
+        Py_END_ALLOW_THREADS
+    }
+    close(fd);
+    if (!ok || output == NULL) {
+        Py_XDECREF(output);
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("(iN)", header.status, output);
+}
+
+// 一時ファイルに書いてから rename するので、他プロセスが途中の状態を読むことはない
+// 一時ファイルは mkostemp() で毎回別の名前で作るので、同じキーを別スレッドが同時に書いても混ざらない
+// *grown にはキャッシュの合計サイズの増分を入れる。既存のエントリを上書きした場合はその分を引く
+static int
+spam_cache_store(CacheObject *self, PyObject *key, int status, PyObject *output, long long *grown) {
+    SpamCacheHeader header;
+    PyObject *path, *tmp;
+    struct stat st;
+    long long written, previous = 0;
+    int fd, ok;
+
+    path = spam_cache_entry_path(self, key, "");
+    tmp = PyBytes_FromFormat("%s.tmp.XXXXXX", path == NULL ? "" : PyBytes_AS_STRING(path));
+    if (path == NULL || tmp == NULL) {
+        Py_XDECREF(path);
+        Py_XDECREF(tmp);
+        return -1;
+    }
+    memcpy(header.magic, SPAM_CACHE_MAGIC, sizeof(header.magic));
+    header.status = status;
+    header.key_len = (uint32_t) PyBytes_GET_SIZE(key);
+    header.output_len = (uint64_t) PyBytes_GET_SIZE(output);
+    written = (long long) (sizeof(header) + header.key_len + header.output_len);
+
+    Py_BEGIN_ALLOW_THREADS
+    // tmp はここで作ったばかりで他から参照されていないので、中身を書き換えてよい
+    fd = mkostemp(PyBytes_AS_STRING(tmp), O_CLOEXEC);
+    ok = fd >= 0
+         && fchmod(fd, 0644) == 0
+         && spam_write_full(fd, (const char *) &header, sizeof(header)) == 0
+         && spam_write_full(fd, PyBytes_AS_STRING(key), header.key_len) == 0
+         && spam_write_full(fd, PyBytes_AS_STRING(output), header.output_len) == 0;
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    if (ok && stat(PyBytes_AS_STRING(path), &st) == 0 && S_ISREG(st.st_mode)) {
+        previous = st.st_size;
+    }
+    ok = ok && rename(PyBytes_AS_STRING(tmp), PyBytes_AS_STRING(path)) == 0;
+    if (!ok && fd >= 0) {
+        unlink(PyBytes_AS_STRING(tmp));
+    }
+    Py_END_ALLOW_THREADS
+    *grown = written - previous;
+    Py_DECREF(path);
+    Py_DECREF(tmp);
+    // キャッシュへの書き込み失敗は結果に影響しないので無視する
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    char name[32];
+    long long size;
+    struct timespec mtime;
+} SpamCacheEntry;
+
+static int
+spam_cache_entry_cmp(const void *a, const void *b) {
+    const SpamCacheEntry *x = a, *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// ディレクトリを走査して合計サイズを数え直し、limit を超えていれば古い順に消す
+// 戻り値は消したエントリ数。GIL を解放したまま呼ぶ
+static long long
+spam_cache_scan(const char *directory, long long limit, long long *total) {
+    SpamCacheEntry *entries = NULL, *grown;
+    size_t n = 0, cap = 0;
+    long long removed = 0;
+    struct dirent *d;
+    struct stat st;
+    DIR *dir;
+    int dfd;
+
+    *total = 0;
+    dir = opendir(directory);
+    if (dir == NULL) {
+        return 0;
+    }
+    dfd = dirfd(dir);
+    while ((d = readdir(dir)) != NULL) {
+        // エントリ名は 16 桁の 16 進数だけ。一時ファイルなどは数えない
+        if (strlen(d->d_name) != 16 || strspn(d->d_name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            grown = realloc(entries, cap * sizeof(SpamCacheEntry));
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+        strcpy(entries[n].name, d->d_name);
+        entries[n].size = st.st_size;
+        entries[n].mtime = st.st_mtim;
+        *total += st.st_size;
+        n++;
+    }
+    if (limit >= 0 && *total > limit) {
+        qsort(entries, n, sizeof(SpamCacheEntry), spam_cache_entry_cmp);
+        for (size_t i = 0; i < n && *total > limit; i++) {
+            if (unlinkat(dfd, entries[i].name, 0) == 0) {
+                *total -= entries[i].size;
+                removed++;
+            }
+        }
+    }
+    closedir(dir);
+    free(entries);
+    return removed;
+}
+
+static void
+Cache_dealloc(CacheObject *self) {
+    Py_XDECREF(self->directory);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Cache_init(CacheObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"directory", "max_bytes", NULL};
+    PyObject *directory, *encoded, *tmp;
+    long long max_bytes = 1LL << 30, total;
+    int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|L", kwlist, PyUnicode_FSDecoder, &directory, &max_bytes)) {
+        return -1;
+    }
+    if (!PyUnicode_FSConverter(directory, &encoded)) {
+        Py_DECREF(directory);
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = mkdir(PyBytes_AS_STRING(encoded), 0755);
+    if (r < 0 && errno == EEXIST) {
+        r = 0;
+    }
+    if (r == 0) {
+        spam_cache_scan(PyBytes_AS_STRING(encoded), -1, &total);
+    }
+    Py_END_ALLOW_THREADS
+    if (r < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, directory);
+        Py_DECREF(encoded);
+        Py_DECREF(directory);
+        return -1;
+    }
+    Py_DECREF(encoded);
+    tmp = self->directory;
+    self->directory = directory;
+    Py_XDECREF(tmp);
+    self->max_bytes = max_bytes;
+    self->size = total;
+    return 0;
+}
+
+static PyObject *
+Cache_run(CacheObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"argv", "inputs", "stderr", NULL};
+    PyObject *command, *inputs = NULL, *key = NULL, *path = NULL, *result = NULL, *output, *encoded;
+    long long grown, total, removed;
+    char **argv;
+    int merge_stderr = 0, status;
+
+    if (self->directory == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Cache is not initialized");
+        return NULL;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Op", kwlist, &command, &inputs, &merge_stderr)) {
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    key = spam_cache_key(argv, inputs);
+    if (key == NULL) {
+        goto done;
+    }
+    // stderr を含めるかどうかで出力が変わるのでキーに入れる
+    PyBytes_ConcatAndDel(&key, PyBytes_FromString(merge_stderr ? "\x1e" "2>&1" : "\x1e"));
+    if (key == NULL) {
+        goto done;
+    }
+    path = spam_cache_entry_path(self, key, "");
+    if (path == NULL) {
+        goto done;
+    }
+    result = spam_cache_lookup(path, key);
+    if (result == NULL || result != Py_None) {
+        if (result != NULL) {
+            self->hits++;
+        }
+        goto done;
+    }
+    Py_CLEAR(result);
+    self->misses++;
+
+    output = spam_capture(argv, merge_stderr, -1.0, -1, &status);
+    if (output == NULL) {
+        goto done;
+    }
+    if (spam_cache_store(self, key, status, output, &grown) == 0) {
+        self->size += grown;
+        if (self->size > self->max_bytes) {
+            if (PyUnicode_FSConverter(self->directory, &encoded)) {
+                Py_BEGIN_ALLOW_THREADS
+                removed = spam_cache_scan(PyBytes_AS_STRING(encoded), SPAM_CACHE_LOW_WATER(self->max_bytes), &total);
+                Py_END_ALLOW_THREADS
+                Py_DECREF(encoded);
+                self->size = total;
+                self->evictions += removed;
+            } else {
+                PyErr_Clear();
+            }
+        }
+    }
+    result = Py_BuildValue("(iN)", status, output);
+done:
+    spam_argv_free(argv);
+    Py_XDECREF(key);
+    Py_XDECREF(path);
+    return result;
+}
+
+static PyObject *
+Cache_clear(CacheObject *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *encoded;
+    long long total, removed;
+
+    if (self->directory == NULL || !PyUnicode_FSConverter(self->directory, &encoded)) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Cache is not initialized");
+        }
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    removed = spam_cache_scan(PyBytes_AS_STRING(encoded), 0, &total);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(encoded);
+    self->size = total;
+    self->evictions += removed;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Cache_methods[] = {
+        {"run",   (PyCFunction) Cache_run,   METH_VARARGS | METH_KEYWORDS,
+                "run(argv, inputs=(), stderr=False)\n"
+                "Return (status, output) for argv, from the cache if argv and the inputs' inode,\n"
+                "size and mtime are unchanged, otherwise by running it and storing the result."},
+        {"clear", (PyCFunction) Cache_clear, METH_NOARGS, "Remove every cache entry."},
+        {NULL}
+};
+
+static PyMemberDef Cache_members[] = {
+        {"directory", T_OBJECT,   offsetof(CacheObject, directory), READONLY, "cache directory"},
+        {"max_bytes", T_LONGLONG, offsetof(CacheObject, max_bytes), 0,        "size limit of the cache directory"},
+        {"size",      T_LONGLONG, offsetof(CacheObject, size),      READONLY, "bytes currently stored"},
+        {"hits",      T_LONGLONG, offsetof(CacheObject, hits),      READONLY, "lookups answered from the cache"},
+        {"misses",    T_LONGLONG, offsetof(CacheObject, misses),    READONLY, "lookups that ran the command"},
+        {"evictions", T_LONGLONG, offsetof(CacheObject, evictions), READONLY, "entries removed to honour max_bytes"},
+        {NULL},
+};
+
+static PyTypeObject CacheType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "spam.Cache",
+        .tp_doc = "Cache(directory, max_bytes=1 << 30)\n"
+                  "Opt-in on-disk result cache for commands that are pure functions of argv and input files.\n"
+                  "Once the directory exceeds max_bytes, least recently used entries are evicted\n"
+                  "until it is down to 90% of max_bytes.",
+        .tp_basicsize = sizeof(CacheObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_new = PyType_GenericNew,
+        .tp_init = (initproc) Cache_init,
+        .tp_dealloc = (destructor) Cache_dealloc,
+        .tp_methods = Cache_methods,
+        .tp_members = Cache_members,
+};
+
+// ---- ForkServer ----
+// 親が小さいうちに fork しておいた補助プロセスに exec を代行させる
+// 要求は SOCK_SEQPACKET のソケットで送り、返信用ソケットと標準入出力は SCM_RIGHTS で渡す
+// カレントディレクトリと環境変数は補助プロセスを起動したときのものが使われ、後からの変更は届かない
+
+// 1 要求あたりの argv の最大バイト数と、補助プロセスが同時に面倒を見る子の数
+#define SPAM_FS_MSG_MAX (128 * 1024)
+#define SPAM_FS_MAX_CHILDREN 1024
+#define SPAM_FS_NFDS 4  // 返信用ソケット, stdin, stdout, stderr
+
+// 補助プロセスからの返信。起動直後に PID を、終了時に status を送る
+typedef struct {
+    int32_t kind;
+    int32_t value;  // kind が PID のとき、起動失敗なら -errno
+} SpamFsReply;
+
+#define SPAM_FS_REPLY_PID 1
+#define SPAM_FS_REPLY_STATUS 2
+
+typedef struct {
+    pid_t pid;
+    int pidfd;
+    int reply_fd;
+} SpamFsChild;
+
+// 以下は補助プロセス内でのみ動く。マルチスレッドの親から fork している可能性があるので、
+// malloc や Python の API は使わず、静的領域とシステムコールだけで処理する
+static char spam_fs_msg[SPAM_FS_MSG_MAX + 1];
+static char *spam_fs_argv[SPAM_FS_MSG_MAX / 2 + 1];
+static SpamFsChild spam_fs_children[SPAM_FS_MAX_CHILDREN];
+
+static void
+spam_fs_reply(int fd, int32_t kind, int32_t value) {
+    SpamFsReply reply = {kind, value};
+    // 親が待つのをやめていても補助プロセスは止めない
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+static void
+spam_fs_exec_child(int fds[SPAM_FS_NFDS], volatile int *exec_errno) {
+    sigset_t all;
+    int sig;
+
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i + 1], i) < 0) {
+            *exec_errno = errno;
+            _exit(127);
+        }
+    }
+    // 補助プロセスで無視しているシグナルは exec 後も無視されたままになるので戻す
+    for (sig = 1; sig < NSIG; sig++) {
+        signal(sig, SIG_DFL);
+    }
+    sigemptyset(&all);
+    sigprocmask(SIG_SETMASK, &all, NULL);
+    execvp(spam_fs_argv[0], spam_fs_argv);
+    *exec_errno = errno;
+    _exit(127);
+}
+
+// 要求を 1 つ受け取って子を起動する。制御ソケットが閉じられたら -1
+static int
+spam_fs_accept(int control_fd, int epfd) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * SPAM_FS_NFDS)];
+    } cmsg;
+    struct iovec iov = {spam_fs_msg, SPAM_FS_MSG_MAX};
+    struct msghdr msg = {0};
+    struct cmsghdr *c;
+    struct epoll_event ev;
+    int fds[SPAM_FS_NFDS], nfds = 0, slot, argc = 0, pidfd;
+    volatile int exec_errno = 0;
+    ssize_t n;
+    pid_t pid;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    n = recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (int) ((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(c), sizeof(int) * (nfds < SPAM_FS_NFDS ? nfds : SPAM_FS_NFDS));
+        }
+    }
+    if (nfds != SPAM_FS_NFDS) {
+        for (int i = 0; i < nfds && i < SPAM_FS_NFDS; i++) {
+            close(fds[i]);
+        }
+        return 0;
+    }
+
+    // argv は NUL 区切りで詰めて送られてくる
+    spam_fs_msg[n] = '\0';
+    for (char *p = spam_fs_msg; p < spam_fs_msg + n; p += strlen(p) + 1) {
+        spam_fs_argv[argc++] = p;
+    }
+    spam_fs_argv[argc] = NULL;
+
+    for (slot = 0; slot < SPAM_FS_MAX_CHILDREN && spam_fs_children[slot].pid != 0; slot++) {
+    }
+    if (argc == 0 || slot == SPAM_FS_MAX_CHILDREN) {
+        spam_fs_reply(fds[0], SPAM_FS_REPLY_PID, argc == 0 ? -EINVAL : -EAGAIN);
+        goto close_fds;
+    }
+    // 補助プロセスは小さいので vfork でもページテーブルのコピーはほぼ発生しない
+    pid = vfork();
+    if (pid == 0) {
+        spam_fs_exec_child(fds, &exec_errno);
+    }
+    if (pid < 0 || exec_errno != 0) {
+        spam_fs_reply(fds[0], SPAM_FS_REPLY_PID, pid < 0 ? -errno : -exec_errno);
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+        goto close_fds;
+    }
+    pidfd = spam_pidfd_open(pid);
+    if (pidfd < 0) {
+        // 終了を監視できないので、起動したことにせず回収してしまう
+        spam_fs_reply(fds[0], SPAM_FS_REPLY_PID, -errno);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        goto close_fds;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t) slot + 1;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        // 監視できなければ終了 status を返せず、呼び出し側が待ち続けることになる
+        spam_fs_reply(fds[0], SPAM_FS_REPLY_PID, -errno);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(pidfd);
+        goto close_fds;
+    }
+    spam_fs_children[slot].pid = pid;
+    spam_fs_children[slot].pidfd = pidfd;
+    spam_fs_children[slot].reply_fd = fds[0];
+    spam_fs_reply(fds[0], SPAM_FS_REPLY_PID, pid);
+    fds[0] = -1;
+close_fds:
+    for (int i = 0; i < SPAM_FS_NFDS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return 0;
+}
+
+static void
+spam_fs_main(int control_fd) {
+    struct epoll_event ev, events[64];
+    int epfd, n, i, status;
+
+    // Ctrl-C は親 (Python) に任せる
+    signal(SIGINT, SIG_IGN);
+    // 親から引き継いだ fd は制御ソケットと標準入出力以外すべて閉じる
+    if (dup2(control_fd, 3) < 0) {
+        _exit(1);
+    }
+    control_fd = 3;
+    if (syscall(SYS_close_range, 4, ~0U, 0) < 0) {
+        for (i = 4; i < 1024; i++) {
+            close(i);
+        }
+    }
+    fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        _exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &ev);
+    for (;;) {
+        n = epoll_wait(epfd, events, 64, -1);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 == 0) {
+                if (spam_fs_accept(control_fd, epfd) < 0) {
+                    // 親が閉じたので終了する。起動済みの子はそのまま残す
+                    _exit(0);
+                }
+                continue;
+            }
+            SpamFsChild *child = &spam_fs_children[events[i].data.u64 - 1];
+            while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            spam_fs_reply(child->reply_fd, SPAM_FS_REPLY_STATUS, status);
+            close(child->reply_fd);
+            close(child->pidfd);
+            child->pid = 0;
+        }
+    }
+    _exit(1);
+}
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    int control_fd;    // 閉じたら -1
+    pid_t pid;         // 補助プロセスの PID
+} ForkServerObject;
+
+static int
+ForkServer_shutdown(ForkServerObject *self) {
+    int status;
+
+    if (self->control_fd < 0) {
+        return 0;
+    }
+    // 制御ソケットを閉じると補助プロセスは終了する
+    close(self->control_fd);
+    self->control_fd = -1;
+    Py_BEGIN_ALLOW_THREADS
+    while (waitpid(self->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    Py_END_ALLOW_THREADS
+    return 0;
+}
+
+static void
+ForkServer_dealloc(ForkServerObject *self) {
+    ForkServer_shutdown(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
 static PyObject *
-spam_system(PyObject *self, PyObject *args) {
-    const char *command;
+ForkServer_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {NULL};
+    ForkServerObject *self;
+    int sv[2];
+    pid_t pid;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+        return NULL;
+    }
+    self = (ForkServerObject *) type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->control_fd = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        Py_DECREF(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    // 子では Python の状態に一切触れないので PyOS_BeforeFork() などは呼ばない
+    pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        spam_fs_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        Py_DECREF(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    self->control_fd = sv[0];
+    self->pid = pid;
+    return (PyObject *) self;
+}
+
+// 補助プロセスからの返信を 1 つ読む。GIL を解放した状態で呼ぶ
+static int
+spam_fs_recv(int fd, SpamFsReply *reply) {
+    ssize_t n;
+
+    do {
+        n = recv(fd, reply, sizeof(*reply), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(*reply)) {
+        errno = n < 0 ? errno : EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+ForkServer_run(ForkServerObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"argv", "capture", NULL};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * SPAM_FS_NFDS)];
+    } cmsg;
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *c;
+    SpamFsReply reply;
+    PyObject *command, *output = NULL, *result;
+    PyThreadState *tstate;
+    Py_ssize_t out_len = 0;
+    char **argv, *packed;
+    size_t size = 0;
+    int capture = 0, sv[2], pipefd[2] = {-1, -1}, fds[SPAM_FS_NFDS], err = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", kwlist, &command, &capture)) {
+        return NULL;
+    }
+    if (self->control_fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "ForkServer is closed");
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    for (char **p = argv; *p != NULL; p++) {
+        size += strlen(*p) + 1;
+    }
+    if (size > SPAM_FS_MSG_MAX) {
+        spam_argv_free(argv);
+        PyErr_SetString(PyExc_ValueError, "argv is too long for the fork server");
+        return NULL;
+    }
+    packed = PyMem_Malloc(size);
+    if (packed == NULL) {
+        spam_argv_free(argv);
+        return PyErr_NoMemory();
+    }
+    size = 0;
+    for (char **p = argv; *p != NULL; p++) {
+        size_t len = strlen(*p) + 1;
+        memcpy(packed + size, *p, len);
+        size += len;
+    }
+    spam_argv_free(argv);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        PyMem_Free(packed);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (capture && spam_capture_pipe(pipefd) < 0) {
+        PyMem_Free(packed);
+        close(sv[0]);
+        close(sv[1]);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    fds[0] = sv[1];
+    fds[1] = 0;
+    fds[2] = capture ? pipefd[1] : 1;
+    fds[3] = 2;
+
+    iov.iov_base = packed;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * SPAM_FS_NFDS);
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    tstate = PyEval_SaveThread();
+    if (sendmsg(self->control_fd, &msg, MSG_NOSIGNAL) < 0) {
+        err = errno;
+    }
+    // 送った fd は補助プロセス側に複製されているので、こちらの分は閉じる
+    close(sv[1]);
+    if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+    }
+    if (err == 0 && spam_fs_recv(sv[0], &reply) < 0) {
+        err = errno;
+    } else if (err == 0 && reply.value < 0) {
+        err = -reply.value;
+    }
+    if (err == 0 && capture) {
+        Py_ssize_t n;
+        while ((n = spam_read_into(pipefd[0], &output, &out_len, &tstate)) > 0) {
+        }
+        if (n < 0) {
+            kill(reply.value, SIGKILL);
+        }
+    }
+    if (err == 0 && spam_fs_recv(sv[0], &reply) < 0) {
+        err = errno;
+    }
+    close(sv[0]);
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+    }
+    PyEval_RestoreThread(tstate);
+    PyMem_Free(packed);
+
+    if (PyErr_Occurred()) {
+        Py_XDECREF(output);
+        return NULL;
+    }
+    if (err != 0) {
+        Py_XDECREF(output);
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (!capture) {
+        return PyLong_FromLong(reply.value);
+    }
+    result = spam_take_output(&output, out_len);
+    if (result == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(iN)", reply.value, result);
+}
+
+static PyObject *
+ForkServer_close(ForkServerObject *self, PyObject *Py_UNUSED(ignored)) {
+    ForkServer_shutdown(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ForkServer_enter(ForkServerObject *self, PyObject *Py_UNUSED(ignored)) {
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+ForkServer_exit(ForkServerObject *self, PyObject *args) {
+    ForkServer_shutdown(self);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef ForkServer_methods[] = {
+        {"run",       (PyCFunction) ForkServer_run,   METH_VARARGS | METH_KEYWORDS,
+                "run(argv, capture=False)\n"
+                "Execute argv through the fork server and return its status like system(),\n"
+                "or (status, stdout) if capture is true.\n"
+                "argv runs in the ForkServer's original working directory and environment."},
+        {"close",     (PyCFunction) ForkServer_close, METH_NOARGS,  "Stop the fork server process."},
+        {"__enter__", (PyCFunction) ForkServer_enter, METH_NOARGS,  NULL},
+        {"__exit__",  (PyCFunction) ForkServer_exit,  METH_VARARGS, NULL},
+        {NULL}
+};
+
+static PyMemberDef ForkServer_members[] = {
+        {"pid", T_INT, offsetof(ForkServerObject, pid), READONLY, "pid of the fork server process"},
+        {NULL},
+};
+
+static PyTypeObject ForkServerType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "spam.ForkServer",
+        .tp_doc = "ForkServer()\n"
+                  "Start a small helper process that spawns commands on behalf of this process.\n"
+                  "Create it early, while the interpreter is small, so spawn cost stays flat.\n"
+                  "Commands run in the working directory and environment the helper was started with.\n"
+                  "Later os.chdir() calls and os.environ changes in this process are not applied;\n"
+                  "create a new ForkServer after changing them.",
+        .tp_basicsize = sizeof(ForkServerObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_new = ForkServer_new,
+        .tp_dealloc = (destructor) ForkServer_dealloc,
+        .tp_methods = ForkServer_methods,
+        .tp_members = ForkServer_members,
+};
+
+// ---- Process (spawn_async) ----
+// pidfd とパイプの fd をそのまま見せて、イベントループの add_reader で監視できるようにする
+
+typedef struct {
+    PyObject ob_base;  // == PyObject_HEAD
+    pid_t pid;
+    int pidfd;         // 閉じたら -1
+    int stdout_fd;     // capture しないときは -1。非ブロッキング
     int status;
+    int exited;
+    double start;      // rusage 集計用の起動時刻
+    PyObject *loop;    // await 中のイベントループと Future
+    PyObject *waiter;
+} ProcessObject;
+
+static int
+Process_traverse(ProcessObject *self, visitproc visit, void *arg) {
+    Py_VISIT(self->loop);
+    Py_VISIT(self->waiter);
+    return 0;
+}
+
+static int
+Process_clear(ProcessObject *self) {
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->waiter);
+    return 0;
+}
+
+static void
+Process_close_fds(ProcessObject *self) {
+    if (self->pidfd >= 0) {
+        close(self->pidfd);
+        self->pidfd = -1;
+    }
+    if (self->stdout_fd >= 0) {
+        close(self->stdout_fd);
+        self->stdout_fd = -1;
+    }
+}
+
+static void
+Process_dealloc(ProcessObject *self) {
+    PyObject_GC_UnTrack(self);
+    Process_clear(self);
+    // 実行中の子は止めない。回収されないままならゾンビとして残る
+    if (!self->exited) {
+        if (spam_wait(self->pid, &self->status, WNOHANG, self->start, NULL) == self->pid) {
+            self->exited = 1;
+        }
+    }
+    Process_close_fds(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// await 中なら add_reader の登録を外し、Future を完了させる
+// exc が NULL なら終了 status を、そうでなければ exc を例外として渡す
+// pidfd を閉じる前に必ず呼ぶ。登録が残ったまま閉じると Future は完了せず、
+// 番号が再利用されたときにセレクタが無関係な fd を監視してしまう
+static int
+Process_resolve_waiter(ProcessObject *self, PyObject *exc) {
+    PyObject *waiter = self->waiter, *loop = self->loop, *r;
+    PyObject *type = NULL, *value = NULL, *tb = NULL;
+
+    if (waiter == NULL) {
+        Py_CLEAR(self->loop);
+        return 0;
+    }
+    self->waiter = NULL;
+    self->loop = NULL;
+    if (loop != NULL && self->pidfd >= 0) {
+        r = PyObject_CallMethod(loop, "remove_reader", "i", self->pidfd);
+        if (r == NULL) {
+            // Future は完了させてから例外を戻す
+            PyErr_Fetch(&type, &value, &tb);
+        }
+        Py_XDECREF(r);
+    }
+    r = PyObject_CallMethod(waiter, "done", NULL);
+    if (r != NULL && !PyObject_IsTrue(r)) {
+        Py_DECREF(r);
+        if (exc == NULL) {
+            r = PyObject_CallMethod(waiter, "set_result", "i", self->status);
+        } else {
+            r = PyObject_CallMethod(waiter, "set_exception", "O", exc);
+        }
+    }
+    Py_DECREF(waiter);
+    Py_XDECREF(loop);
+    if (type != NULL) {
+        // remove_reader の失敗を優先して返す
+        Py_XDECREF(r);
+        PyErr_Restore(type, value, tb);
+        return -1;
+    }
+    if (r == NULL) {
+        return -1;
+    }
+    Py_DECREF(r);
+    return 0;
+}
+
+// 終了していれば回収して 1、まだなら 0、エラーなら例外をセットして -1
+static int
+Process_reap(ProcessObject *self, int options) {
+    pid_t pid;
+    int r;
+
+    if (self->exited) {
+        return 1;
+    }
+    if (options & WNOHANG) {
+        pid = spam_wait(self->pid, &self->status, options, self->start, NULL);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        pid = spam_wait(self->pid, &self->status, options, self->start, NULL);
+        Py_END_ALLOW_THREADS
+    }
+    if (pid < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    if (pid == 0) {
+        return 0;
+    }
+    self->exited = 1;
+    // poll() や wait() で先に回収された場合も await している側に status を渡す
+    r = Process_resolve_waiter(self, NULL);
+    // 回収後は PID が再利用され得るので pidfd も閉じておく
+    if (self->pidfd >= 0) {
+        close(self->pidfd);
+        self->pidfd = -1;
+    }
+    return r < 0 ? -1 : 1;
+}
+
+static PyObject *
+Process_poll(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    int r = Process_reap(self, WNOHANG);
 
-    if (!PyArg_ParseTuple(args, "s", &command)) {
+    if (r < 0) {
         return NULL;
     }
-    status = system(command);
-    return PyLong_FromLong(status);
+    if (r == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(self->status);
+}
+
+static PyObject *
+Process_wait(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    if (Process_reap(self, 0) < 0) {
+        return NULL;
+    }
+    return PyLong_FromLong(self->status);
+}
+
+static PyObject *
+Process_send_signal(ProcessObject *self, PyObject *args) {
+    int sig;
+
+    if (!PyArg_ParseTuple(args, "i", &sig)) {
+        return NULL;
+    }
+    // pidfd 経由なので、回収済みの PID が別プロセスに再利用されていても誤爆しない
+    if (self->exited) {
+        Py_RETURN_NONE;
+    }
+    // close() の後は pidfd がないので送れない。黙って何もしないと止めたつもりの子が残る
+    if (self->pidfd < 0) {
+        PyErr_SetString(PyExc_ValueError, "Process is closed");
+        return NULL;
+    }
+    if (syscall(SYS_pidfd_send_signal, self->pidfd, sig, NULL, 0) < 0 && errno != ESRCH) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Process_kill(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *args = Py_BuildValue("(i)", SIGKILL), *result;
+
+    if (args == NULL) {
+        return NULL;
+    }
+    result = Process_send_signal(self, args);
+    Py_DECREF(args);
+    return result;
+}
+
+static PyObject *
+Process_read(ProcessObject *self, PyObject *args) {
+    Py_ssize_t size = SPAM_READ_CHUNK;
+    PyObject *result;
+    ssize_t n;
+
+    if (!PyArg_ParseTuple(args, "|n", &size)) {
+        return NULL;
+    }
+    if (self->stdout_fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "stdout is not captured");
+        return NULL;
+    }
+    if (size <= 0) {
+        size = SPAM_READ_CHUNK;
+    }
+    result = PyBytes_FromStringAndSize(NULL, size);
+    if (result == NULL) {
+        return NULL;
+    }
+    do {
+        n = read(self->stdout_fd, PyBytes_AS_STRING(result), size);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        Py_DECREF(result);
+        if (errno == EAGAIN) {
+            // まだデータがない。add_reader から再度呼ばれるのを待つ
+            Py_RETURN_NONE;
+        }
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (_PyBytes_Resize(&result, n) < 0) {
+        return NULL;
+    }
+    return result;
+}
+
+// add_reader に登録するコールバック。pidfd が読めるようになったら子が終了している
+// 回収できれば Process_reap() が Future を完了させる
+static PyObject *
+Process_on_exit(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *type, *value, *tb;
+    int reaped = Process_reap(self, WNOHANG);
+
+    if (reaped < 0 && self->waiter != NULL) {
+        // 例外は Future に渡して await した側で受け取らせる
+        PyErr_Fetch(&type, &value, &tb);
+        PyErr_NormalizeException(&type, &value, &tb);
+        reaped = Process_resolve_waiter(self, value);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+    }
+    if (reaped < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Process_on_exit_def = {
+        "_on_exit", (PyCFunction) Process_on_exit, METH_NOARGS, NULL
+};
+
+// await proc で終了 status を返す。スレッドもポーリングも使わず pidfd を add_reader で待つ
+static PyObject *
+Process_await(ProcessObject *self) {
+    PyObject *asyncio, *loop, *waiter, *callback, *r;
+
+    if (self->waiter != NULL) {
+        return PyObject_CallMethod(self->waiter, "__await__", NULL);
+    }
+    if (!self->exited && self->pidfd < 0) {
+        PyErr_SetString(PyExc_ValueError, "Process is closed");
+        return NULL;
+    }
+    asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL) {
+        return NULL;
+    }
+    loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    Py_DECREF(asyncio);
+    if (loop == NULL) {
+        return NULL;
+    }
+    waiter = PyObject_CallMethod(loop, "create_future", NULL);
+    if (waiter == NULL) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+    if (self->exited) {
+        r = PyObject_CallMethod(waiter, "set_result", "i", self->status);
+    } else {
+        callback = PyCFunction_New(&Process_on_exit_def, (PyObject *) self);
+        if (callback == NULL) {
+            Py_DECREF(waiter);
+            Py_DECREF(loop);
+            return NULL;
+        }
+        r = PyObject_CallMethod(loop, "add_reader", "iO", self->pidfd, callback);
+        Py_DECREF(callback);
+        if (r != NULL) {
+            Py_INCREF(waiter);
+            self->waiter = waiter;
+            Py_INCREF(loop);
+            self->loop = loop;
+        }
+    }
+    Py_DECREF(loop);
+    if (r == NULL) {
+        Py_DECREF(waiter);
+        return NULL;
+    }
+    Py_DECREF(r);
+    r = PyObject_CallMethod(waiter, "__await__", NULL);
+    Py_DECREF(waiter);
+    return r;
+}
+
+static PyObject *
+Process_close(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    PyObject *exc;
+    int r = 0;
+
+    // まだ終了していないのに pidfd を閉じると、await している側は結果を受け取れなくなる
+    if (self->waiter != NULL) {
+        exc = PyObject_CallFunction(PyExc_ValueError, "s", "Process was closed while being awaited");
+        if (exc == NULL) {
+            return NULL;
+        }
+        r = Process_resolve_waiter(self, exc);
+        Py_DECREF(exc);
+    }
+    Process_close_fds(self);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Process_fileno(ProcessObject *self, PyObject *Py_UNUSED(ignored)) {
+    return PyLong_FromLong(self->pidfd);
+}
+
+static PyObject *
+Process_getreturncode(ProcessObject *self, void *closure) {
+    if (!self->exited) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(self->status);
+}
+
+static PyMethodDef Process_methods[] = {
+        {"poll",        (PyCFunction) Process_poll,        METH_NOARGS,
+                "Reap the child if it has exited and return its status, otherwise None."},
+        {"wait",        (PyCFunction) Process_wait,        METH_NOARGS,
+                "Block until the child exits and return its status."},
+        {"send_signal", (PyCFunction) Process_send_signal, METH_VARARGS,
+                "Send a signal to the child through its pidfd."},
+        {"kill",        (PyCFunction) Process_kill,        METH_NOARGS,  "Send SIGKILL to the child."},
+        {"read",        (PyCFunction) Process_read,        METH_VARARGS,
+                "read(size=65536)\n"
+                "Read from the captured stdout. Return b'' at EOF and None if no data is ready."},
+        {"fileno",      (PyCFunction) Process_fileno,      METH_NOARGS,  "Return the pidfd."},
+        {"close",       (PyCFunction) Process_close,       METH_NOARGS,
+                "Close the pidfd and the stdout pipe. A child that is still running can then no longer\n"
+                "be signalled or awaited, but poll() and wait() still reap it."},
+        {NULL}
+};
+
+static PyMemberDef Process_members[] = {
+        {"pid",    T_INT, offsetof(ProcessObject, pid),       READONLY, "process id"},
+        {"pidfd",  T_INT, offsetof(ProcessObject, pidfd),     READONLY,
+                "pidfd that becomes readable when the child exits, or -1 once reaped"},
+        {"stdout", T_INT, offsetof(ProcessObject, stdout_fd), READONLY,
+                "non-blocking read end of the stdout pipe, or -1"},
+        {NULL},
+};
+
+static PyGetSetDef Process_getsetters[] = {
+        {"returncode", (getter) Process_getreturncode, NULL, "exit status like system(), or None while running", NULL},
+        {NULL}
+};
+
+static PyAsyncMethods Process_as_async = {
+        .am_await = (unaryfunc) Process_await,
+};
+
+static PyTypeObject ProcessType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+                .tp_name = "spam.Process",
+        .tp_doc = "Handle for a child started by spam.spawn_async(). Awaiting it returns the exit status.",
+        .tp_basicsize = sizeof(ProcessObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+        .tp_dealloc = (destructor) Process_dealloc,
+        .tp_traverse = (traverseproc) Process_traverse,
+        .tp_clear = (inquiry) Process_clear,
+        .tp_as_async = &Process_as_async,
+        .tp_methods = Process_methods,
+        .tp_members = Process_members,
+        .tp_getset = Process_getsetters,
+};
+
+static PyObject *
+spam_spawn_async(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"argv", "capture", NULL};
+    PyObject *command;
+    ProcessObject *proc;
+    char **argv;
+    int capture = 0, pipefd[2] = {-1, -1}, err;
+    pid_t pid;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", kwlist, &command, &capture)) {
+        return NULL;
+    }
+    argv = spam_argv_from_object(command);
+    if (argv == NULL) {
+        return NULL;
+    }
+    if (capture && spam_capture_pipe(pipefd) < 0) {
+        spam_argv_free(argv);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    proc = PyObject_GC_New(ProcessObject, &ProcessType);
+    if (proc == NULL) {
+        spam_argv_free(argv);
+        if (capture) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+        return NULL;
+    }
+    proc->pid = 0;
+    proc->pidfd = -1;
+    proc->stdout_fd = -1;
+    proc->status = 0;
+    proc->exited = 1;
+    proc->start = 0.0;
+    proc->loop = NULL;
+    proc->waiter = NULL;
+
+    proc->start = spam_monotonic();
+    err = spam_spawn(argv, -1, pipefd[1], -1, 0, &pid);
+    if (capture) {
+        close(pipefd[1]);
+    }
+    if (err != 0) {
+        if (capture) {
+            close(pipefd[0]);
+        }
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, argv[0]);
+        spam_argv_free(argv);
+        Py_DECREF(proc);
+        return NULL;
+    }
+    spam_argv_free(argv);
+    proc->pid = pid;
+    proc->exited = 0;
+    proc->stdout_fd = pipefd[0];
+    if (proc->stdout_fd >= 0) {
+        fcntl(proc->stdout_fd, F_SETFL, fcntl(proc->stdout_fd, F_GETFL) | O_NONBLOCK);
+    }
+    proc->pidfd = spam_pidfd_open(pid);
+    if (proc->pidfd < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        kill(pid, SIGKILL);
+        Process_reap(proc, 0);
+        Py_DECREF(proc);
+        return NULL;
+    }
+    PyObject_GC_Track(proc);
+    return (PyObject *) proc;
 }
 
+#endif /* SPAM_HAVE_PIDFD */
+
 static PyMethodDef SpamMethod[] = {
-        {"system", spam_system, METH_VARARGS, "Execute a shell command."},
-        {NULL,     NULL,        0,            NULL},
+        {"system",   (PyCFunction) spam_system,            METH_VARARGS | METH_KEYWORDS,
+                "system(command, timeout=None, cancel=None)\n"
+                "Execute a shell command.\n"
+                "With a timeout in seconds or a spam.Canceller, the command runs in its own process group,\n"
+                "which is killed on expiry (spam.TimeoutExpired) or cancellation (spam.Cancelled)."},
+#ifdef SPAM_HAVE_PIDFD
+        {"run_many", (PyCFunction) spam_run_many, METH_VARARGS | METH_KEYWORDS,
+                "run_many(commands, max_parallel=0, capture=False)\n"
+                "Run commands with at most max_parallel (default: CPU count) children at a time.\n"
+                "A str command runs via /bin/sh like system(); a sequence is executed as argv.\n"
+                "Return the exit statuses in submission order, or (status, stdout) tuples if capture is true."},
+        {"run_graph", (PyCFunction) spam_run_graph, METH_VARARGS | METH_KEYWORDS,
+                "run_graph(jobs, deps=None, max_parallel=0)\n"
+                "Run a dict of named commands, starting each one as soon as all of its deps\n"
+                "(a dict mapping a name to the names it depends on) have succeeded.\n"
+                "Jobs whose dependencies failed are skipped. Return a spam.graph_result with\n"
+                "per-job timings and the critical path."},
+        {"check_output", (PyCFunction) spam_check_output, METH_VARARGS | METH_KEYWORDS,
+                "check_output(argv, stderr=False, timeout=None, cancel=None)\n"
+                "Run argv and return its stdout as bytes, read straight into the result without extra copies.\n"
+                "If stderr is true, stderr is captured into the same buffer.\n"
+                "timeout and cancel behave as in system().\n"
+                "Raise spam.error('command failed', status, output) on a non-zero status."},
+        {"pipeline", (PyCFunction) spam_pipeline, METH_VARARGS | METH_KEYWORDS,
+                "pipeline(stages, capture=False)\n"
+                "Run stages like 'cmd1 | cmd2 | ...' without a shell, connecting them with pipes.\n"
+                "Return the list of statuses, or (statuses, stdout of the last stage) if capture is true."},
+        {"run_rusage", spam_run_rusage, METH_VARARGS,
+                "run_rusage(command)\n"
+                "Run command and return a spam.rusage_result with its status, wall time,\n"
+                "CPU times, max RSS, page faults and context switches (from wait4)."},
+        {"rusage_totals", spam_rusage_totals, METH_NOARGS,
+                "Return resource usage summed over every child spam has reaped."},
+        {"reset_rusage_totals", spam_reset_rusage_totals, METH_NOARGS,
+                "Reset the counters returned by rusage_totals()."},
+        {"iter_lines", (PyCFunction) spam_iter_lines, METH_VARARGS | METH_KEYWORDS,
+                "iter_lines(argv, bufsize=65536)\n"
+                "Start argv and return an iterator yielding its stdout line by line as bytes,\n"
+                "using a fixed bufsize ring buffer. Lines longer than bufsize are split."},
+        {"spawn_async", (PyCFunction) spam_spawn_async, METH_VARARGS | METH_KEYWORDS,
+                "spawn_async(argv, capture=False)\n"
+                "Start argv and return a spam.Process exposing its pidfd (and stdout pipe if capture is true)\n"
+                "for event loop add_reader(). The process can be awaited for its exit status."},
+#endif
+        {NULL,       NULL,                                 0,            NULL},
 };
 
 static PyModuleDef spammodule = {
@@ -44,6 +3397,95 @@ PyInit_spam(void) {
         Py_DECREF(m);
         return NULL;
     }
+#ifdef SPAM_HAVE_PIDFD
+    SpamTimeoutExpired = PyErr_NewException("spam.TimeoutExpired", SpamError, NULL);
+    Py_XINCREF(SpamTimeoutExpired);
+    if (PyModule_AddObject(m, "TimeoutExpired", SpamTimeoutExpired) < 0) {
+        Py_XDECREF(SpamTimeoutExpired);
+        Py_CLEAR(SpamTimeoutExpired);
+        Py_DECREF(m);
+        return NULL;
+    }
+    SpamCancelled = PyErr_NewException("spam.Cancelled", SpamError, NULL);
+    Py_XINCREF(SpamCancelled);
+    if (PyModule_AddObject(m, "Cancelled", SpamCancelled) < 0) {
+        Py_XDECREF(SpamCancelled);
+        Py_CLEAR(SpamCancelled);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&CancellerType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&CancellerType);
+    if (PyModule_AddObject(m, "Canceller", (PyObject *) &CancellerType) < 0) {
+        Py_DECREF(&CancellerType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (SpamRusageType.tp_name == NULL) {
+        if (PyStructSequence_InitType2(&SpamRusageType, &spam_rusage_desc) < 0
+            || PyStructSequence_InitType2(&SpamTotalsType, &spam_totals_desc) < 0
+            || PyStructSequence_InitType2(&SpamJobResultType, &spam_job_result_desc) < 0
+            || PyStructSequence_InitType2(&SpamGraphResultType, &spam_graph_result_desc) < 0) {
+            Py_DECREF(m);
+            return NULL;
+        }
+    }
+    Py_INCREF(&SpamRusageType);
+    if (PyModule_AddObject(m, "rusage_result", (PyObject *) &SpamRusageType) < 0) {
+        Py_DECREF(&SpamRusageType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&SpamTotalsType);
+    if (PyModule_AddObject(m, "rusage_totals_result", (PyObject *) &SpamTotalsType) < 0) {
+        Py_DECREF(&SpamTotalsType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&LineIteratorType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&LineIteratorType);
+    if (PyModule_AddObject(m, "LineIterator", (PyObject *) &LineIteratorType) < 0) {
+        Py_DECREF(&LineIteratorType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&CacheType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&CacheType);
+    if (PyModule_AddObject(m, "Cache", (PyObject *) &CacheType) < 0) {
+        Py_DECREF(&CacheType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&ForkServerType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&ProcessType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ProcessType);
+    if (PyModule_AddObject(m, "Process", (PyObject *) &ProcessType) < 0) {
+        Py_DECREF(&ProcessType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ForkServerType);
+    if (PyModule_AddObject(m, "ForkServer", (PyObject *) &ForkServerType) < 0) {
+        Py_DECREF(&ForkServerType);
+        Py_DECREF(m);
+        return NULL;
+    }
+#endif
 
     return m;
 }